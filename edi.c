@@ -7,8 +7,12 @@
 // ******** INCLUDES ********
 
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
@@ -18,11 +22,48 @@
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__SSE2__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
 
 // ******** DEFINES ********
 #define EDI_VERSION "0.0.1"
 #define EDI_TAB_STOP 8
 #define EDI_QUIT_TIMES 3
+// Rows keep the rx of every EDI_RX_CHECKPOINT-th char so converting
+// between cx and rx never walks more than this many chars
+#define EDI_RX_CHECKPOINT 4096
+// What editorUtf8Decode() gives for bytes that are not valid UTF-8
+#define EDI_UTF8_INVALID 0x110000
+// Runs of one char longer than this are sent compressed (see editorDrawRun)
+#define EDI_RUN_MIN 6
+// Frame delivery times (ms) and output rates (bytes/ms) past which
+// rendering switches to the cheaper modes in editorRenderMode
+#define EDI_LEAN_DELAY 100
+#define EDI_LEAN_RATE 100
+#define EDI_PLAIN_DELAY 400
+#define EDI_PLAIN_RATE 10
+// How long to wait for a cursor position report before giving up on it
+#define EDI_REPORT_TIMEOUT 2000
+// Time (ms) a frame may spend moving the highlight frontier towards the
+// rows it shows, and how many rows are scanned between clock checks
+#define EDI_HL_BUDGET 5
+#define EDI_HL_BATCH 1024
+// The highlight worker prepares this many screens of rows above and below
+// the view, copying at most this many bytes of them per batch
+#define EDI_HL_PREFETCH 2
+#define EDI_HL_PREFETCH_BYTES (1 << 20)
+// Moving the frontier across at least two chunks of EDI_HL_CHUNK rows is
+// split among up to EDI_HL_THREADS threads (see editorSyntaxSpeculate)
+#define EDI_HL_CHUNK 16384
+#define EDI_HL_THREADS 64
+// Kinds of brackets matched: (), [] and {}. The bracket index sums
+// blocks of EDI_BRACKET_BLOCK rows.
+#define EDI_BRACKETS 3
+#define EDI_BRACKET_BLOCK 64
 
 #define CTRL_KEY(k) ((k) & 0x1F)
 
@@ -47,13 +88,96 @@ enum editorHighlight {
     HL_KEYWORD2,
     HL_STRING,
     HL_NUMBER,
-    HL_MATCH
+    HL_MATCH,
+    HL_BRACKET
 };
 
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRINGS (1<<1)
 
+// Classes of bytes in editorSyntax.char_class, for what the highlighter
+// has to look at more closely
+#define CC_SEPARATOR (1<<0)
+#define CC_DIGIT (1<<1)      // Only with HL_HIGHLIGHT_NUMBERS
+#define CC_QUOTE (1<<2)      // Only with HL_HIGHLIGHT_STRINGS
+#define CC_COMMENT (1<<3)    // First byte of a comment delimiter
+
+// Fixed states of a syntax's lexer DFA: outside strings and comments,
+// after a separator, inside a word, or just after a digit of a number.
+// String, comment and delimiter prefix states follow these.
+#define DFA_SEP 0
+#define DFA_WORD 1
+#define DFA_NUMBER 2
+#define DFA_NORMAL_STATES 3
+
+// What a DFA transition does with the byte taking it (see editorSyntaxScan)
+enum editorDfaAction {
+    DFA_EMIT = 0,   // Give the byte class 'hl', go to 'next'
+    DFA_RUN,        // The same for every following byte taking this edge
+    DFA_KEYWORD,    // A word starts: a keyword gets its class, else DFA_EMIT
+    DFA_ESCAPE,     // A backslash in a string and the byte after it are string
+    DFA_PREFIX,     // Maybe part of a comment delimiter; hl is not known yet
+    DFA_FAIL,       // The bytes since the prefix started were no delimiter
+    DFA_SCS,        // A single line comment starts and runs to the row's end
+    DFA_MCS         // A multiline comment starts
+};
+
+// Longest comment delimiter and number of string quotes a syntax may have,
+// so every DFA state fits in a byte
+#define EDI_DELIM_MAX 15
+#define EDI_QUOTES_MAX 8
+
+// Rows at each end of a file searched for a modeline, as in vim
+#define EDI_MODELINES 5
+
+// A run in the generic lexer goes byte by byte for EDI_SKIP_AFTER bytes,
+// then skips blocks of bytes that fall in one of EDI_SKIP_RANGES ranges
+#define EDI_SKIP_RANGES 4
+#define EDI_SKIP_AFTER 16
+
+// Search queries this long or longer are matched with Horspool's shifts
+// rather than by filtering on their first and last bytes
+#define EDI_SEARCH_LONG 128
+
+// AVX2 code is built with a target attribute and only used when the CPU
+// has it
+#if defined(__SSE2__) && defined(__GNUC__)
+#define EDI_AVX2
+#endif
+
 // ******** DATA ********
+
+// A slot of a syntax's keyword hash table
+struct editorKeyword {
+    const char* word;   // NULL for an empty slot
+    int len;
+    unsigned char hl;   // HL_KEYWORD1 or HL_KEYWORD2
+};
+
+// Byte ranges that take a DFA state's DFA_RUN edges, as lo and hi - lo.
+// Unused ranges repeat the first.
+struct editorSkip {
+    int ranges;
+    unsigned char lo[EDI_SKIP_RANGES];
+    unsigned char span[EDI_SKIP_RANGES];
+};
+
+// Highlighting of render[start, start + len)
+struct editorHlRun {
+    int start;
+    int len;
+    unsigned char hl;
+};
+
+struct editorDfaEdge {
+    unsigned char next;
+    unsigned char hl;
+    unsigned char action;
+};
+
+struct erow;
+struct editorHlState;
+
 struct editorSyntax {
     char* file_type;
     char** file_match;
@@ -61,24 +185,222 @@ struct editorSyntax {
     char* singleline_comment_start;
     char* multiline_comment_start;
     char* multiline_comment_end;
+    char* quotes;    // Chars that open and close strings
     int flags;
+    // Built by editorCompileSyntax() when the syntax is first selected
+    int compiled;
+    unsigned char char_class[256];  // CC_* bits of each byte
+    char state_stops[16];           // Bytes with CC_QUOTE or CC_COMMENT
+    int scs_len;
+    int mcs_len;
+    int mce_len;
+    // Perfect hash of keywords. No two keywords share a slot, so a word
+    // is classified with one hash and one compare.
+    struct editorKeyword* keyword_slots;
+    unsigned int keyword_mask;
+    unsigned int keyword_seed;
+    int keyword_max_len;
+    // Lexer DFA, 256 edges per state. dfa_alt has the edges of the normal
+    // states as if no comment delimiter started anywhere.
+    struct editorDfaEdge* dfa;
+    struct editorDfaEdge* dfa_alt;
+    int dfa_string;    // First string state, one per char of quotes
+    int dfa_comment;   // Multiline comment, then states for each prefix of its end
+    int dfa_prefix;    // Prefixes of comment starts, up to dfa_states
+    int dfa_pending;   // States from here on are inside a delimiter
+    int dfa_states;
+    unsigned char* dfa_accept;  // Prefix states that complete the multiline start
+    struct editorSkip* dfa_skip;  // For each state, bytes its runs skip over
+    // Scanner used by editorSyntaxScan(): editorSyntaxScanDfa(), or one
+    // generated for this syntax at build time (see LEXER GENERATOR)
+    int (*scan)(struct erow* row, int i, int limit, struct editorHlState* st);
+};
+
+// A file_match pattern or file type name in HLDB_index. 'kind' says which:
+// '.' extension, 'n' base name, '!' interpreter, '=' file type.
+struct editorSyntaxKey {
+    const char* key;   // NULL for an empty slot
+    int len;
+    char kind;
+    struct editorSyntax* syntax;
+};
+
+// A search query, prepared once for all the rows it is run over (see
+// editorSearchPrepare)
+struct editorSearch {
+    char* needle;
+    int len;
+    int shift[256];  // Horspool shifts, used for needles of EDI_SEARCH_LONG or more
+};
+
+// A range of a row's render drawn in class 'hl' instead of its syntax
+// highlighting, such as a search match
+struct editorOverlay {
+    int row;
+    int start;
+    int end;
+    unsigned char hl;
+};
+
+// Balance of one kind of bracket over some text outside strings and
+// comments, counting opening brackets +1 and closing ones -1: net is the
+// total and min the lowest the count gets on the way (0 at most). A
+// bracket opened 'depth' deep before the text is closed in it when
+// depth + min <= 0, and one closed after it is opened in it when
+// net - min >= depth.
+struct editorBracketSum {
+    int net;
+    int min;
+};
+
+// A node of the bracket index, summing its rows for each kind of bracket.
+// dirty counts the rows in it without a summary, which are left out of sum.
+struct editorBracketNode {
+    struct editorBracketSum sum[EDI_BRACKETS];
+    int dirty;
+};
+
+// A position in a row, as an index into chars, a screen column and an
+// index into render
+struct erowPos {
+    int cx;
+    int rx;
+    int ri;
 };
 
 typedef struct erow {
     int idx;
     int size;
     int rsize;
+    int ascii;        // Only ASCII bytes, so every render byte is one column
+    int rwidth;       // Width of render in columns
+    int hidden;       // In a fold, so not shown
     char* chars;
     char* render;
+    // Highlighting, one byte per render byte, or as runs when those take
+    // less memory (hl_runs is then set and hl is NULL). Only a row being
+    // highlighted or edited needs the bytes. Neither is kept for a row that
+    // was changed and not yet shown again.
     unsigned char* hl;
-    int hl_open_comment;
+    struct editorHlRun* hl_runs;
+    int hl_nruns;
+    int hl_open_comment;   // Row ends inside a multiline comment
+    // Comment state at the start of the row that hl_open_comment (and hl,
+    // if hl_ready) were worked out from, or -1 if the row changed since.
+    // This is the row's highlighting checkpoint: while the row before
+    // still ends in this state, none of it needs scanning again.
+    int hl_start_comment;
+    int hl_ready;          // hl is up to date for hl_start_comment
+    unsigned int hl_epoch; // Changes whenever render does
+    // rx_ckpt[k] is the last char boundary at or before
+    // chars[(k + 1) * EDI_RX_CHECKPOINT]
+    struct erowPos* rx_ckpt;
+    int rx_ckpt_len;  // Number of leading rx_ckpt entries that are up to date
+    // Bracket balance of the row, worked out from hl. Cleared whenever hl
+    // changes (editorBracketTouch) and summed again when next needed.
+    struct editorBracketSum br_sum[EDI_BRACKETS];
+    int br_ready;
 } erow;
 
+// Maps between rows and the screen lines they are shown on: a Fenwick tree
+// (1-based, 'valid' rows indexed) over the lines each row takes less one,
+// as counted by lines(). When cols is set the counts are for that screen
+// width and are all redone when it changes.
+struct editorLineIndex {
+    int* tree;
+    int cap;
+    int valid;
+    int cols;
+    int (*lines)(erow* row);
+};
+
+// How much work frames may cost the link, picked from its measured speed
+enum editorRenderMode {
+    RENDER_FULL = 0,  // Colors everywhere, a frame for every view
+    RENDER_LEAN,      // Colors on the cursor's row only
+    RENDER_PLAIN      // No colors
+};
+
+enum editorViewLine {
+    VIEW_TEXT = 0,
+    VIEW_TILDE,
+    VIEW_WELCOME
+};
+
+// Everything needed to draw one frame, copied out of the editor state by
+// the input thread so the render thread can draw it while input goes on.
+struct editorView {
+    int screen_rows;
+    int screen_cols;
+    int* line_kind;      // One editorViewLine per screen line
+    int* line_len;       // Length of the text on VIEW_TEXT lines
+    int line_cap;        // Bytes of text reserved per screen line
+    char* text;          // Render bytes for each screen line
+    unsigned char* hl;   // Highlighting of text
+    char status[80];
+    int status_len;
+    char rstatus[80];
+    int rstatus_len;
+    char msg[80];
+    int msg_len;
+    int cursor_y;
+    int cursor_x;
+    int render_mode;     // The editorRenderMode to draw with
+    double input_time;   // When the key this view reflects was read, or 0
+    double apply_time;   // When the view was published
+};
+
+// Latency instrumentation, printed on exit when EDI_STATS is set. The
+// input thread owns the first group of fields and the render thread the
+// rest; they are only read together after the render thread is joined.
+struct editorStats {
+    int applied;
+    double input_apply_sum;
+    double input_apply_max;
+    int views_skipped;
+    int frames;
+    double apply_paint_sum;
+    double apply_paint_max;
+    int hl_prefetched;
+    int hl_applied;
+    int hl_stale;
+    int hl_chunks;        // Chunks the frontier was moved across in parallel
+    int hl_chunks_wrong;  // Of those, ones that guessed their start state wrong
+};
+
+// A row copied out for the highlight worker, tagged with the row's epoch
+struct editorHlJob {
+    int idx;
+    unsigned int epoch;
+    int start;  // Comment state at the start, -1 to go on from the job before
+    int end;    // Comment state at the end, filled in by the worker
+    int rsize;
+    char* render;
+    unsigned char* hl;
+    struct editorHlRun* runs;   // Set by the worker instead of hl if smaller
+    int nruns;
+};
+
+// Rows [from, to) of the frontier's way, scanned by one thread as if the
+// first started in state 'start'. done is the row it stopped at, which is
+// 'to' unless the deadline passed. Rows whose bracket summary it made
+// stale are listed in touched for the input thread to deal with.
+struct editorHlChunk {
+    int from;
+    int to;
+    int start;
+    int done;
+    int* touched;
+    int touched_len;
+};
+
 struct editorConfig {
     int cx, cy;
     int rx;
     int row_offset;
     int col_offset;
+    int wrap;         // Soft wrap long rows instead of scrolling horizontally
+    int line_offset;  // First screen line shown (see editorScreenLineOf)
     int screen_rows;
     int screen_cols;
     int num_rows;
@@ -88,6 +410,103 @@ struct editorConfig {
     char statusmsg[80];
     time_t statusmsg_time;
     struct editorSyntax* syntax;
+    // Drawn over the rows on screen, sorted by row and then start, and
+    // rebuilt for every frame (editorOverlayBuild). find is the search
+    // whose matches it shows; its needle is NULL when there is none.
+    struct editorOverlay* overlay;
+    int overlay_len;
+    int overlay_cap;
+    struct editorSearch find;
+    // Screen lines of each row when wrapping, and when not (one for each
+    // row not hidden by a fold; only used while hidden_rows is set)
+    struct editorLineIndex wrap_index;
+    struct editorLineIndex fold_index;
+    int hidden_rows;
+    // Segment tree over blocks of EDI_BRACKET_BLOCK rows (node 1 is the
+    // root, node i has children 2i and 2i + 1, and block b is leaf
+    // br_leaves + b). Leaves before br_valid, padding included, are
+    // summed in it.
+    struct editorBracketNode* br_tree;
+    int br_leaves;
+    int br_valid;
+    // While br_bottom is set, searches for the bracket pair may only sum
+    // rows [br_top, br_bottom), and br_pending is set if one gave up
+    int br_top;
+    int br_bottom;
+    int br_pending;
+    // Rows before this one have hl_open_comment worked out from the start
+    // of the file. Rows are only highlighted once shown, so rows past it
+    // are checked lazily against their checkpoints.
+    int hl_frontier;
+    // While set, moving the frontier stops at this time (editorNow()) and
+    // rows past it are highlighted from their checkpoints provisionally.
+    // hl_provisional is the last such row shown, or -1.
+    double hl_deadline;
+    int hl_provisional;
+    int hl_threads;         // Threads the frontier may be moved with
+    unsigned int hl_epoch;  // Last epoch given to a row
+    // Rows are highlighted into this, and only copied out if they don't
+    // end up stored as runs
+    unsigned char* hl_scratch;
+    int hl_scratch_cap;
+    // The highlight worker takes the batch in hl_jobs (under hl_lock) and
+    // leaves it highlighted in hl_done. hl_busy is set while it works.
+    pthread_t hl_thread;
+    pthread_mutex_t hl_lock;
+    pthread_cond_t hl_cond;
+    int hl_started;
+    int hl_quit;
+    int hl_busy;
+    struct editorHlJob* hl_jobs;
+    int hl_jobs_len;
+    struct editorHlJob* hl_done;
+    int hl_done_len;
+    // hl_threads - 1 threads kept to scan chunks of the frontier's way
+    // alongside the input thread (see editorSyntaxSpeculate). Under
+    // hl_pool_lock, the chunks of one move are in hl_chunks: those before
+    // hl_chunks_next are taken and hl_chunks_left are not finished yet.
+    pthread_t* hl_pool;
+    int hl_pool_len;
+    pthread_mutex_t hl_pool_lock;
+    pthread_cond_t hl_pool_cond;
+    pthread_cond_t hl_pool_done;
+    struct editorHlChunk* hl_chunks;
+    int hl_chunks_len;
+    int hl_chunks_next;
+    int hl_chunks_left;
+    // The render thread draws the newest published view (view_next, under
+    // render_lock; a newer view replaces one not drawn yet) and writes it
+    // through a non-blocking handle on the terminal. out_buf is the frame
+    // being written and out_pos how much of it is out. Writing to
+    // render_wake wakes the thread up.
+    pthread_t render_thread;
+    pthread_mutex_t render_lock;
+    int render_started;
+    int render_quit;
+    int render_wake[2];
+    struct editorView* view_next;
+    int out_fd;
+    char* out_buf;
+    int out_len;
+    int out_pos;
+    double key_time;
+    struct editorStats stats;
+    int sync_output;  // Terminal supports synchronized updates (mode 2026)
+    int term_rep;     // Terminal repeats the last char with REP (CSI b)
+    int term_ech;     // Terminal erases chars in place with ECH (CSI X)
+    char* last_frame; // Last frame written, to skip sending an identical one
+    int last_len;
+    // Link measurements, under render_lock. Frames end with a cursor
+    // position query; the time until the input thread reads the report is
+    // how long frames take to reach the terminal. The rate is measured
+    // over the time writes were blocked.
+    double report_sent;  // When the outstanding query went out, or 0
+    int report_seen;     // The terminal has answered a query before
+    double link_delay;   // Smoothed frame delivery time in ms
+    double link_rate;    // Smoothed bytes per ms while blocked, 0 if never
+    int render_mode;
+    double out_blocked;  // When writing the current frame first blocked, or 0
+    int out_blocked_pos;
     struct termios orig_termios;
 };
 
@@ -95,7 +514,11 @@ struct editorConfig E;
 
 // ******** FILE TYPES ********
 
-char* C_HL_extensions[] = { ".c", ".h", ".cpp", NULL };
+// file_match patterns are extensions (".c"), base names ("Makefile") and
+// interpreters named on a #! line ("#!python"). A file type name is also
+// what a vim or Emacs modeline asks for.
+
+char* C_HL_extensions[] = { ".c", ".h", ".cpp", ".cc", ".cxx", ".hpp", ".hh", NULL };
 char* C_HL_keywords[] = {
         "break", "case", "class", "const", "continue", "default", "do",
         "else", "enum", "extern", "for", "goto", "if", "register",
@@ -106,25 +529,348 @@ char* C_HL_keywords[] = {
         "signed|", "unsigned|", "void|", NULL
 };
 
+char* PYTHON_HL_extensions[] = { ".py", ".pyw", ".pyi", "SConstruct", "SConscript", "#!python", NULL };
+char* PYTHON_HL_keywords[] = {
+        "and", "as", "assert", "async", "await", "break", "class", "continue",
+        "def", "del", "elif", "else", "except", "finally", "for", "from",
+        "global", "if", "import", "in", "is", "lambda", "nonlocal", "not",
+        "or", "pass", "raise", "return", "try", "while", "with", "yield",
+
+        "False|", "None|", "True|", "self|", "bool|", "bytes|", "dict|",
+        "float|", "int|", "list|", "object|", "set|", "str|", "tuple|", NULL
+};
+
+char* SH_HL_extensions[] = {
+        ".sh", ".bash", ".zsh", ".ksh", ".bashrc", ".bash_profile", ".profile",
+        ".zshrc", "#!sh", "#!bash", "#!zsh", "#!ksh", "#!dash", "#!ash", NULL
+};
+char* SH_HL_keywords[] = {
+        "if", "then", "else", "elif", "fi", "case", "esac", "for", "while",
+        "until", "do", "done", "in", "function", "select", "return", "exit",
+        "break", "continue", "local", "export", "readonly", "declare",
+        "set", "unset", "shift", "source", "alias", "trap", "eval", "exec",
+
+        "cd|", "echo|", "false|", "printf|", "read|", "test|", "true|", NULL
+};
+
+char* JS_HL_extensions[] = { ".js", ".mjs", ".cjs", ".jsx", "#!node", NULL };
+char* JS_HL_keywords[] = {
+        "async", "await", "break", "case", "catch", "class", "const",
+        "continue", "debugger", "default", "delete", "do", "else", "export",
+        "extends", "finally", "for", "function", "if", "import", "in",
+        "instanceof", "let", "new", "of", "return", "super", "switch", "this",
+        "throw", "try", "typeof", "var", "void", "while", "with", "yield",
+
+        "Infinity|", "NaN|", "false|", "null|", "true|", "undefined|", NULL
+};
+
+char* TS_HL_extensions[] = { ".ts", ".tsx", ".mts", ".cts", "#!ts-node", "#!deno", NULL };
+char* TS_HL_keywords[] = {
+        "abstract", "as", "async", "await", "break", "case", "catch", "class",
+        "const", "continue", "declare", "default", "delete", "do", "else",
+        "enum", "export", "extends", "finally", "for", "function", "if",
+        "implements", "import", "in", "instanceof", "interface", "let",
+        "namespace", "new", "of", "private", "protected", "public",
+        "readonly", "return", "super", "switch", "this", "throw", "try",
+        "type", "typeof", "var", "while", "yield",
+
+        "any|", "boolean|", "false|", "never|", "null|", "number|", "string|",
+        "symbol|", "true|", "undefined|", "unknown|", "void|", NULL
+};
+
+char* GO_HL_extensions[] = { ".go", NULL };
+char* GO_HL_keywords[] = {
+        "break", "case", "chan", "const", "continue", "default", "defer",
+        "else", "fallthrough", "for", "func", "go", "goto", "if", "import",
+        "interface", "map", "package", "range", "return", "select", "struct",
+        "switch", "type", "var",
+
+        "bool|", "byte|", "complex64|", "complex128|", "error|", "false|",
+        "float32|", "float64|", "int|", "int8|", "int16|", "int32|", "int64|",
+        "iota|", "nil|", "rune|", "string|", "true|", "uint|", "uint8|",
+        "uint16|", "uint32|", "uint64|", "uintptr|", NULL
+};
+
+char* RUST_HL_extensions[] = { ".rs", NULL };
+char* RUST_HL_keywords[] = {
+        "as", "async", "await", "break", "const", "continue", "crate", "dyn",
+        "else", "enum", "extern", "fn", "for", "if", "impl", "in", "let",
+        "loop", "match", "mod", "move", "mut", "pub", "ref", "return", "self",
+        "Self", "static", "struct", "super", "trait", "type", "unsafe", "use",
+        "where", "while",
+
+        "bool|", "char|", "f32|", "f64|", "i8|", "i16|", "i32|", "i64|",
+        "i128|", "isize|", "str|", "u8|", "u16|", "u32|", "u64|", "u128|",
+        "usize|", "Box|", "Option|", "Result|", "String|", "Vec|", "Some|",
+        "None|", "Ok|", "Err|", "true|", "false|", NULL
+};
+
+char* JAVA_HL_extensions[] = { ".java", NULL };
+char* JAVA_HL_keywords[] = {
+        "abstract", "assert", "break", "case", "catch", "class", "continue",
+        "default", "do", "else", "enum", "extends", "final", "finally", "for",
+        "if", "implements", "import", "instanceof", "interface", "native",
+        "new", "package", "private", "protected", "public", "return",
+        "static", "super", "switch", "synchronized", "this", "throw",
+        "throws", "transient", "try", "var", "volatile", "while",
+
+        "boolean|", "byte|", "char|", "double|", "false|", "float|", "int|",
+        "long|", "null|", "short|", "String|", "true|", "void|", NULL
+};
+
+char* CSHARP_HL_extensions[] = { ".cs", NULL };
+char* CSHARP_HL_keywords[] = {
+        "abstract", "as", "async", "await", "base", "break", "case", "catch",
+        "class", "const", "continue", "default", "delegate", "do", "else",
+        "enum", "event", "explicit", "extern", "finally", "fixed", "for",
+        "foreach", "goto", "if", "implicit", "in", "interface", "internal",
+        "is", "lock", "namespace", "new", "operator", "out", "override",
+        "params", "private", "protected", "public", "readonly", "ref",
+        "return", "sealed", "sizeof", "static", "struct", "switch", "this",
+        "throw", "try", "typeof", "using", "var", "virtual", "while",
+
+        "bool|", "byte|", "char|", "decimal|", "double|", "false|", "float|",
+        "int|", "long|", "null|", "object|", "sbyte|", "short|", "string|",
+        "true|", "uint|", "ulong|", "ushort|", "void|", NULL
+};
+
+char* KOTLIN_HL_extensions[] = { ".kt", ".kts", NULL };
+char* KOTLIN_HL_keywords[] = {
+        "as", "break", "class", "companion", "continue", "data", "do", "else",
+        "enum", "for", "fun", "if", "import", "in", "interface", "is",
+        "lateinit", "object", "open", "override", "package", "private",
+        "protected", "public", "return", "sealed", "super", "this", "throw",
+        "try", "typealias", "val", "var", "when", "while",
+
+        "Any|", "Boolean|", "Char|", "Double|", "Float|", "Int|", "Long|",
+        "String|", "Unit|", "false|", "null|", "true|", NULL
+};
+
+char* SWIFT_HL_extensions[] = { ".swift", NULL };
+char* SWIFT_HL_keywords[] = {
+        "as", "break", "case", "catch", "class", "continue", "default",
+        "defer", "do", "else", "enum", "extension", "fallthrough", "for",
+        "func", "guard", "if", "import", "in", "init", "is", "let",
+        "protocol", "private", "public", "repeat", "return", "self",
+        "static", "struct", "switch", "throw", "throws", "try", "var",
+        "where", "while",
+
+        "Any|", "Bool|", "Character|", "Double|", "Float|", "Int|", "String|",
+        "Void|", "false|", "nil|", "true|", NULL
+};
+
+char* RUBY_HL_extensions[] = {
+        ".rb", ".rake", ".gemspec", "Rakefile", "Gemfile", "#!ruby", NULL
+};
+char* RUBY_HL_keywords[] = {
+        "alias", "and", "begin", "break", "case", "class", "def", "defined?",
+        "do", "else", "elsif", "end", "ensure", "for", "if", "in", "module",
+        "next", "not", "or", "redo", "rescue", "retry", "return", "super",
+        "then", "undef", "unless", "until", "when", "while", "yield",
+
+        "false|", "nil|", "self|", "true|", NULL
+};
+
+char* PERL_HL_extensions[] = { ".pl", ".pm", ".t", "#!perl", NULL };
+char* PERL_HL_keywords[] = {
+        "else", "elsif", "for", "foreach", "if", "last", "local", "my",
+        "next", "no", "our", "package", "redo", "require", "return", "sub",
+        "unless", "until", "use", "while",
+
+        "die|", "pop|", "print|", "printf|", "push|", "shift|", NULL
+};
+
+char* LUA_HL_extensions[] = { ".lua", "#!lua", NULL };
+char* LUA_HL_keywords[] = {
+        "and", "break", "do", "else", "elseif", "end", "for", "function",
+        "goto", "if", "in", "local", "not", "or", "repeat", "return", "then",
+        "until", "while",
+
+        "false|", "nil|", "self|", "true|", NULL
+};
+
+char* PHP_HL_extensions[] = { ".php", "#!php", NULL };
+char* PHP_HL_keywords[] = {
+        "abstract", "as", "break", "case", "catch", "class", "const",
+        "continue", "declare", "default", "do", "echo", "else", "elseif",
+        "extends", "final", "finally", "fn", "for", "foreach", "function",
+        "global", "if", "implements", "include", "instanceof", "interface",
+        "namespace", "new", "private", "protected", "public", "require",
+        "return", "static", "switch", "throw", "trait", "try", "use",
+        "while", "yield",
+
+        "array|", "bool|", "false|", "float|", "int|", "null|", "string|",
+        "true|", NULL
+};
+
+char* HASKELL_HL_extensions[] = { ".hs", ".lhs", "#!runhaskell", NULL };
+char* HASKELL_HL_keywords[] = {
+        "case", "class", "data", "deriving", "do", "else", "if", "import",
+        "in", "infix", "infixl", "infixr", "instance", "let", "module",
+        "newtype", "of", "then", "type", "where",
+
+        "Bool|", "Char|", "Either|", "False|", "IO|", "Int|", "Integer|",
+        "Just|", "Maybe|", "Nothing|", "String|", "True|", NULL
+};
+
+char* SQL_HL_extensions[] = { ".sql", NULL };
+char* SQL_HL_keywords[] = {
+        "ALTER", "AND", "AS", "BY", "CREATE", "DELETE", "DROP", "FROM",
+        "GROUP", "HAVING", "INDEX", "INNER", "INSERT", "INTO", "JOIN", "LEFT",
+        "LIMIT", "NOT", "NULL", "ON", "OR", "ORDER", "OUTER", "RIGHT",
+        "SELECT", "SET", "TABLE", "UNION", "UPDATE", "VALUES", "WHERE",
+        "alter", "and", "as", "by", "create", "delete", "drop", "from",
+        "group", "having", "index", "inner", "insert", "into", "join", "left",
+        "limit", "not", "null", "on", "or", "order", "outer", "right",
+        "select", "set", "table", "union", "update", "values", "where",
+
+        "BIGINT|", "BOOLEAN|", "CHAR|", "DATE|", "INT|", "INTEGER|", "TEXT|",
+        "VARCHAR|", "bigint|", "boolean|", "char|", "date|", "int|",
+        "integer|", "text|", "varchar|", NULL
+};
+
+char* MAKE_HL_extensions[] = {
+        ".mk", ".mak", "Makefile", "makefile", "GNUmakefile", "#!make", NULL
+};
+char* MAKE_HL_keywords[] = {
+        "define", "else", "endef", "endif", "export", "ifdef", "ifeq",
+        "ifndef", "ifneq", "include", "override", "unexport", "vpath", NULL
+};
+
+char* CMAKE_HL_extensions[] = { ".cmake", "CMakeLists.txt", NULL };
+char* CMAKE_HL_keywords[] = {
+        "else", "elseif", "endforeach", "endfunction", "endif", "endmacro",
+        "endwhile", "foreach", "function", "if", "macro", "return", "while",
+
+        "add_executable|", "add_library|", "find_package|", "include|",
+        "message|", "option|", "project|", "set|", NULL
+};
+
+char* DOCKER_HL_extensions[] = { ".dockerfile", "Dockerfile", "Containerfile", NULL };
+char* DOCKER_HL_keywords[] = {
+        "ADD", "ARG", "CMD", "COPY", "ENTRYPOINT", "ENV", "EXPOSE", "FROM",
+        "HEALTHCHECK", "LABEL", "ONBUILD", "RUN", "SHELL", "STOPSIGNAL",
+        "USER", "VOLUME", "WORKDIR", NULL
+};
+
+char* AWK_HL_extensions[] = { ".awk", "#!awk", "#!gawk", "#!mawk", NULL };
+char* AWK_HL_keywords[] = {
+        "BEGIN", "END", "break", "continue", "delete", "do", "else", "exit",
+        "for", "function", "getline", "if", "in", "next", "return", "while",
+
+        "gsub|", "index|", "length|", "print|", "printf|", "split|", "sub|",
+        "substr|", NULL
+};
+
+char* CSS_HL_extensions[] = { ".css", NULL };
+char* CSS_HL_keywords[] = { "!important", NULL };
+
+char* JSON_HL_extensions[] = { ".json", NULL };
+char* YAML_HL_extensions[] = { ".yml", ".yaml", NULL };
+char* TOML_HL_extensions[] = { ".toml", NULL };
+char* CONST_HL_keywords[] = { "false|", "null|", "true|", NULL };
+
 struct editorSyntax HLDB[] = {
-        "c",
-        C_HL_extensions,
-        C_HL_keywords,
-        "//", "/*", "*/",
-        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
+        { "c", C_HL_extensions, C_HL_keywords, "//", "/*", "*/", "\"'",
+          HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS },
+        { "python", PYTHON_HL_extensions, PYTHON_HL_keywords, "#", NULL, NULL, "\"'",
+          HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS },
+        { "sh", SH_HL_extensions, SH_HL_keywords, "#", NULL, NULL, "\"'",
+          HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS },
+        { "javascript", JS_HL_extensions, JS_HL_keywords, "//", "/*", "*/", "\"'`",
+          HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS },
+        { "typescript", TS_HL_extensions, TS_HL_keywords, "//", "/*", "*/", "\"'`",
+          HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS },
+        { "go", GO_HL_extensions, GO_HL_keywords, "//", "/*", "*/", "\"'`",
+          HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS },
+        // No ' quotes: lifetimes ('a) would open a string
+        { "rust", RUST_HL_extensions, RUST_HL_keywords, "//", "/*", "*/", "\"",
+          HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS },
+        { "java", JAVA_HL_extensions, JAVA_HL_keywords, "//", "/*", "*/", "\"'",
+          HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS },
+        { "cs", CSHARP_HL_extensions, CSHARP_HL_keywords, "//", "/*", "*/", "\"'",
+          HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS },
+        { "kotlin", KOTLIN_HL_extensions, KOTLIN_HL_keywords, "//", "/*", "*/", "\"'",
+          HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS },
+        { "swift", SWIFT_HL_extensions, SWIFT_HL_keywords, "//", "/*", "*/", "\"",
+          HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS },
+        { "ruby", RUBY_HL_extensions, RUBY_HL_keywords, "#", "=begin", "=end", "\"'",
+          HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS },
+        { "perl", PERL_HL_extensions, PERL_HL_keywords, "#", NULL, NULL, "\"'",
+          HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS },
+        // "--[[" would never be seen: "--" already starts a comment there
+        { "lua", LUA_HL_extensions, LUA_HL_keywords, "--", NULL, NULL, "\"'",
+          HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS },
+        { "php", PHP_HL_extensions, PHP_HL_keywords, "//", "/*", "*/", "\"'",
+          HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS },
+        { "haskell", HASKELL_HL_extensions, HASKELL_HL_keywords, "--", "{-", "-}", "\"",
+          HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS },
+        { "sql", SQL_HL_extensions, SQL_HL_keywords, "--", "/*", "*/", "'\"",
+          HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS },
+        { "make", MAKE_HL_extensions, MAKE_HL_keywords, "#", NULL, NULL, NULL, 0 },
+        { "cmake", CMAKE_HL_extensions, CMAKE_HL_keywords, "#", NULL, NULL, "\"",
+          HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS },
+        { "dockerfile", DOCKER_HL_extensions, DOCKER_HL_keywords, "#", NULL, NULL, "\"'",
+          HL_HIGHLIGHT_STRINGS },
+        { "awk", AWK_HL_extensions, AWK_HL_keywords, "#", NULL, NULL, "\"",
+          HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS },
+        { "css", CSS_HL_extensions, CSS_HL_keywords, NULL, "/*", "*/", "\"'",
+          HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS },
+        { "json", JSON_HL_extensions, CONST_HL_keywords, NULL, NULL, NULL, "\"",
+          HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS },
+        { "yaml", YAML_HL_extensions, CONST_HL_keywords, "#", NULL, NULL, "\"'",
+          HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS },
+        { "toml", TOML_HL_extensions, CONST_HL_keywords, "#", NULL, NULL, "\"'",
+          HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS },
 };
 
 #define HLDB_ENTRIES (sizeof(HLDB) / sizeof(HLDB[0]))
 
+// Syntaxes read from syntax files at startup, matched before HLDB so a
+// file can also replace a built-in one
+struct editorSyntax* HLDB_loaded = NULL;
+int HLDB_loaded_entries = 0;
+
+// Every file_match pattern and file type name, hashed by
+// editorIndexSyntaxes() so detection takes a few lookups however many
+// syntaxes there are
+struct editorSyntaxKey* HLDB_index = NULL;
+unsigned int HLDB_index_mask;
+
 // ******** PROTOTYPES ********
 
 void editorSetStatusMessage(const char* fmt, ...);
+void editorUpdateSyntax(erow* row);
+int editorSyntaxScanDfa(erow* row, int i, int limit, struct editorHlState* st);
+#ifdef EDI_LEXERS
+extern int (*editorLexers[])(erow* row, int i, int limit, struct editorHlState* st);
+#endif
+void editorSyntaxIdle();
+void editorBracketIdle();
+void editorRowWalk(erow* row, struct erowPos* pos, struct erowPos* limit);
+int editorRowNextChar(erow* row, int cx);
+void editorBracketTouch(erow* row);
+void editorBracketInvalidate(int at);
+void editorHlWorkerSync();
+void editorHlCollect();
+void editorHlPrefetch(int top, int bottom);
 void editorRefreshScreen();
+void editorStopRender();
+void editorLinkReport();
+int editorReadReport(char c);
 char* editorPrompt(char* prompt, void (*callback)(char*, int));
 
 // ******** TERMINAL ********
 
+// Monotonic time in milliseconds, for latency measurements
+double editorNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
 void die(const char* s) {
+    editorStopRender();
     write(STDOUT_FILENO, "\x1b[2J", 4);
     write(STDOUT_FILENO, "\x1b[H", 3);
 
@@ -176,7 +922,12 @@ int editorReadKey() {
         if (nread == -1 && errno != EAGAIN) {
             die("read");
         }
+        // Nothing typed for a while: catch up on highlighting, and on the
+        // bracket pair the last frame gave up on
+        editorSyntaxIdle();
+        editorBracketIdle();
     }
+    E.key_time = editorNow();
 
     if (c == '\x1b') {
         char seq[3];
@@ -197,6 +948,11 @@ int editorReadKey() {
                     return '\x1b';
                 }
 
+                // Reports the terminal sends on its own are not keys
+                if (seq[2] != '~' && editorReadReport(seq[2])) {
+                    return editorReadKey();
+                }
+
                 if (seq[2] == '~') {
                     switch(seq[1]) {
                         case '1':
@@ -244,8 +1000,26 @@ int editorReadKey() {
 
         return '\x1b';
     } else {
-        return c;
+        // Keep bytes of UTF-8 sequences positive, below the editorKey values
+        return (unsigned char) c;
+    }
+}
+
+// Read the rest of a control sequence from the terminal, 'c' being the
+// last byte read, and handle it if it is a cursor position report. Returns
+// whether it was one.
+int editorReadReport(char c) {
+    // Parameter bytes come before the final byte, which is in 0x40-0x7E
+    while (c < 0x40 || c > 0x7E) {
+        if (read(STDIN_FILENO, &c, 1) != 1) {
+            return 0;
+        }
+    }
+    if (c != 'R') {
+        return 0;
     }
+    editorLinkReport();
+    return 1;
 }
 
 int getCursorPosition(int* rows, int* cols) {
@@ -286,6 +1060,60 @@ int getCursorPosition(int* rows, int* cols) {
     return 0;
 }
 
+// Ask the terminal whether it supports synchronized updates (DEC private
+// mode 2026), during which it holds off repainting until the update ends.
+// A primary device attributes request follows the query: every terminal
+// answers that one, so its reply tells us there is nothing more to wait for
+// and terminals that ignore the mode query don't cost a timeout per read.
+void editorDetectTerminal() {
+    // DECRQM reply: \x1b[?2026;<Ps>$y, Ps 1 (set) or 2 (reset) if supported
+    // CPR reply:    \x1b[<row>;<col>R, col 4 if "x" and a REP of 2 more
+    //               moved the cursor 3 columns
+    // DA1 reply:    \x1b[?<level>;<attributes>c, level 62+ for VT220 or later
+    const char* query = "\x1b[?2026$p\rx\x1b[2b\x1b[6n\r\x1b[K\x1b[c";
+
+    E.sync_output = 0;
+    E.term_rep = 0;
+    E.term_ech = 0;
+    if (write(STDOUT_FILENO, query, strlen(query)) != (ssize_t) strlen(query)) {
+        return;
+    }
+
+    char buff[256];
+    unsigned int i = 0;
+    while (i < sizeof(buff) - 1) {
+        // Raw mode reads time out after a tenth of a second
+        if (read(STDIN_FILENO, &buff[i], 1) != 1) {
+            break;
+        }
+        if (buff[i++] == 'c') {
+            break;
+        }
+    }
+    buff[i] = '\0';
+
+    char* mode = strstr(buff, "\x1b[?2026;");
+    if (mode) {
+        int ps = atoi(mode + strlen("\x1b[?2026;"));
+        E.sync_output = (ps == 1 || ps == 2);
+    }
+
+    char* cpr = strchr(buff, 'R');
+    if (cpr) {
+        while (cpr > buff && cpr[-1] != ';' && cpr[-1] != '\x1b') {
+            cpr--;
+        }
+        E.term_rep = (cpr > buff && cpr[-1] == ';' && atoi(cpr) == 4);
+    }
+
+    // ECH is a VT220 control, so also trust it on terminals claiming that level
+    char* da = strrchr(buff, '?');
+    if (da && i > 0 && buff[i - 1] == 'c') {
+        E.term_ech = (atoi(da + 1) >= 62);
+    }
+    E.term_ech = E.term_ech || E.term_rep;
+}
+
 int getWindowSize(int* rows, int* cols) {
     struct winsize ws;
 
@@ -313,242 +1141,2040 @@ int is_separator(int c) {
     return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
 }
 
-void editorUpdateSyntax(erow* row) {
-    row->hl = realloc(row->hl, row->rsize);
-    memset(row->hl, HL_NORMAL, row->rsize);
-
-    if (E.syntax == NULL) {
-        return;
+unsigned int editorKeywordHash(const char* s, int len, unsigned int seed) {
+    unsigned int h = 2166136261u ^ seed;
+    for (int i = 0; i < len; i++) {
+        h = (h ^ (unsigned char) s[i]) * 16777619u;
     }
+    return h ^ (h >> 15);
+}
 
-    char** keywords = E.syntax->keywords;
+// Build the syntax's keyword table: try seeds until every keyword lands in
+// a slot of its own, growing the table if none works. Keywords keep their
+// trailing '|' in the list, which marks them HL_KEYWORD2.
+void editorCompileKeywords(struct editorSyntax* syntax) {
+    int n = 0;
+    syntax->keyword_max_len = 0;
+    while (syntax->keywords[n]) {
+        n++;
+    }
 
-    char* scs = E.syntax->singleline_comment_start;
-    char* mcs = E.syntax->multiline_comment_start;
-    char* mce = E.syntax->multiline_comment_end;
+    unsigned int size = 1;
+    while (size < 2 * (unsigned int) n) {
+        size *= 2;
+    }
 
-    int scs_len = scs ? strlen(scs) : 0;
-    int mcs_len = mcs ? strlen(mcs) : 0;
-    int mce_len = mce ? strlen(mce) : 0;
+    while (1) {
+        struct editorKeyword* slots = calloc(size, sizeof(struct editorKeyword));
+        for (unsigned int seed = 0; seed < 256; seed++) {
+            memset(slots, 0, size * sizeof(struct editorKeyword));
+            int j;
+            for (j = 0; j < n; j++) {
+                const char* word = syntax->keywords[j];
+                int len = strlen(word);
+                unsigned char hl = HL_KEYWORD1;
+                if (word[len - 1] == '|') {
+                    len--;
+                    hl = HL_KEYWORD2;
+                }
 
-    int prev_sep = 1;
-    int in_string = 0;
-    int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+                struct editorKeyword* slot = &slots[editorKeywordHash(word, len, seed) & (size - 1)];
+                if (slot->word) {
+                    // The earlier of two equal keywords wins, as it did
+                    // when the list was searched in order
+                    if (slot->len == len && !strncmp(slot->word, word, len)) {
+                        continue;
+                    }
+                    break;
+                }
+                slot->word = word;
+                slot->len = len;
+                slot->hl = hl;
+                if (len > syntax->keyword_max_len) {
+                    syntax->keyword_max_len = len;
+                }
+            }
 
-    int i = 0;
-    while (i < row->rsize) {
-        char c = row->render[i];
-        unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
-
-        // Handle language-specific singleline comments
-        if (scs_len && !in_string && !in_comment) {
-            // If the current char(s) is equal to scs, then strncmp returns 0 (==> false in C)
-            if (!strncmp(&row->render[i], scs, scs_len)) {
-                memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-                break;
+            if (j == n) {
+                syntax->keyword_slots = slots;
+                syntax->keyword_mask = size - 1;
+                syntax->keyword_seed = seed;
+                return;
             }
         }
+        free(slots);
+        size *= 2;
+    }
+}
 
-        if (mcs_len && mce_len && !in_string) {
-            if (in_comment) {
-                row->hl[i] = HL_MLCOMMENT;
-                if (!strncmp(&row->render[i], mce, mce_len)) {
-                    memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-                    i += mce_len;
-                    in_comment = 0;
-                    prev_sep = 1;
-                    continue;
-                } else {
-                    i++;
-                    continue;
-                }
-            } else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-                memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-                i += mcs_len;
-                in_comment = 1;
+// Edge of normal state 'state' for byte c, if no comment delimiter starts
+// at it. This is the order the highlighter has always checked things in:
+// strings, then numbers, then keywords after a separator.
+struct editorDfaEdge editorDfaNormalEdge(struct editorSyntax* syntax, int state, int c) {
+    unsigned char cc = syntax->char_class[c];
+    struct editorDfaEdge e = {DFA_WORD, HL_NORMAL, DFA_EMIT};
+    if (cc & CC_QUOTE) {
+        e.next = syntax->dfa_string + (strchr(syntax->quotes, c) - syntax->quotes);
+        e.hl = HL_STRING;
+    } else if (((cc & CC_DIGIT) && state != DFA_WORD) || (c == '.' && state == DFA_NUMBER)) {
+        e.next = DFA_NUMBER;
+        e.hl = HL_NUMBER;
+    } else if (cc & CC_SEPARATOR) {
+        e.next = DFA_SEP;
+    } else if (state == DFA_SEP) {
+        if (syntax->keyword_max_len) {
+            e.action = DFA_KEYWORD;
+        }
+    } else if (!cc) {
+        e.action = DFA_RUN;
+    }
+    return e;
+}
+
+// Prefix state for q[0..len), or -1 if that is no proper prefix of a
+// comment start
+int editorDfaPrefixState(struct editorSyntax* syntax, const char* q, int len) {
+    char* starts[] = {
+        syntax->scs_len ? syntax->singleline_comment_start : NULL,
+        syntax->dfa_pending > syntax->dfa_comment ? syntax->multiline_comment_start : NULL
+    };
+    int state = syntax->dfa_prefix;
+    for (int d = 0; d < 2; d++) {
+        if (starts[d] == NULL) {
+            continue;
+        }
+        int n = strlen(starts[d]);
+        for (int k = 1; k < n; k++) {
+            // Prefixes shared with the single line start are counted there
+            if (d == 1 && starts[0] && k < (int) strlen(starts[0]) && !strncmp(starts[0], starts[1], k)) {
                 continue;
             }
+            if (k == len && !strncmp(q, starts[d], k)) {
+                return state;
+            }
+            state++;
         }
+    }
+    return -1;
+}
 
-        if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-            if (in_string) {
-                row->hl[i] = HL_STRING;
+// Edge for byte c after q[0..len) of a comment start has been seen. On a
+// mismatch the bytes since the start are replayed through dfa_alt.
+struct editorDfaEdge editorDfaPrefixEdge(struct editorSyntax* syntax, char* q, int len, int c) {
+    char* scs = syntax->singleline_comment_start;
+    char* mcs = syntax->multiline_comment_start;
+    struct editorDfaEdge e = {0, HL_NORMAL, DFA_FAIL};
+    q[len++] = c;
+    int next = editorDfaPrefixState(syntax, q, len);
+    if (syntax->scs_len == len && !strncmp(q, scs, len)) {
+        e.action = DFA_SCS;
+    } else if (next != -1) {
+        e.next = next;
+        e.action = DFA_PREFIX;
+    } else if (syntax->dfa_pending > syntax->dfa_comment && syntax->mcs_len == len && !strncmp(q, mcs, len)) {
+        e.action = DFA_MCS;
+    }
+    return e;
+}
 
-                // Handling the case when string is enclosed with escaped quotes
-                // Ex: \"Hello Word\"
-                if (c == '\\' && i + 1 < row->rsize) {
-                    row->hl[i + 1] = HL_STRING;
-                    i += 2;
-                    continue;
-                }
+// Compile the syntax into a DFA so the highlighter takes one transition
+// per byte. States are the normal ones, one per string quote, one per
+// prefix of the multiline comment end matched so far (KMP style) and one
+// per proper prefix of a comment start.
+void editorCompileDfa(struct editorSyntax* syntax) {
+    int quotes = (syntax->flags & HL_HIGHLIGHT_STRINGS) ? strlen(syntax->quotes) : 0;
+    int multiline = syntax->mcs_len && syntax->mce_len;
+    char* mce = syntax->multiline_comment_end;
+
+    syntax->dfa_string = DFA_NORMAL_STATES;
+    syntax->dfa_comment = syntax->dfa_string + quotes;
+    syntax->dfa_prefix = syntax->dfa_comment + (multiline ? syntax->mce_len : 0);
+    syntax->dfa_pending = multiline ? syntax->dfa_comment + 1 : syntax->dfa_prefix;
+    syntax->dfa_states = syntax->dfa_prefix;
+    char* starts[] = { syntax->singleline_comment_start, syntax->multiline_comment_start };
+    for (int d = 0; d < 2; d++) {
+        int n = (d == 0) ? syntax->scs_len : (multiline ? syntax->mcs_len : 0);
+        for (int k = 1; k < n; k++) {
+            if (editorDfaPrefixState(syntax, starts[d], k) >= syntax->dfa_states) {
+                syntax->dfa_states++;
+            }
+        }
+    }
 
-                // If current char is end quote, turn off in_string flag
-                if (c == in_string) {
-                    in_string = 0;
-                }
-                i++;
-                // Set prev_sep to 1 so that if highlighting string is
-                // complete, the close quote is considered a separator
-                prev_sep = 1;
-                continue;
-            } else {
-                if (c == '"' || c == '\'') {
-                    in_string = c;
-                    row->hl[i] = HL_STRING;
-                    i++;
-                    continue;
+    syntax->dfa = malloc(sizeof(struct editorDfaEdge) * syntax->dfa_states * 256);
+    syntax->dfa_alt = malloc(sizeof(struct editorDfaEdge) * DFA_NORMAL_STATES * 256);
+    syntax->dfa_accept = calloc(syntax->dfa_states, 1);
+
+    char q[EDI_DELIM_MAX + 1];
+    for (int c = 0; c < 256; c++) {
+        for (int state = 0; state < DFA_NORMAL_STATES; state++) {
+            struct editorDfaEdge e = editorDfaNormalEdge(syntax, state, c);
+            syntax->dfa_alt[state * 256 + c] = e;
+            if (syntax->char_class[c] & CC_COMMENT) {
+                struct editorDfaEdge p = editorDfaPrefixEdge(syntax, q, 0, c);
+                if (p.action != DFA_FAIL) {
+                    e = p;
                 }
             }
+            syntax->dfa[state * 256 + c] = e;
         }
 
-        if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-            if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
-                (c == '.' && prev_hl == HL_NUMBER)) {
-                row->hl[i] = HL_NUMBER;
-                i++;
-                prev_sep = 0;
-                continue;
+        for (int k = 0; k < quotes; k++) {
+            struct editorDfaEdge e = {syntax->dfa_string + k, HL_STRING, DFA_RUN};
+            if (c == '\\') {
+                e.action = DFA_ESCAPE;
+            } else if (c == (unsigned char) syntax->quotes[k]) {
+                e.next = DFA_SEP;
+                e.action = DFA_EMIT;
             }
+            syntax->dfa[(syntax->dfa_string + k) * 256 + c] = e;
         }
 
-        // Keywords should start with a separator, so
-        // check if previous character was a separator.
-        // Ex: 'void' should match; 'avoidable' should not match
-        if (prev_sep) {
-            int j;
-            for (j = 0; keywords[j]; j++) {
-                int klen = strlen(keywords[j]);
-                int kw2 = keywords[j][klen - 1] == '|';
-                if (kw2) {
-                    klen--;
-                }
-
-                // If the following char sequence matches a keyword and
-                // ends with a separator, then it's a keyword
-                if (!strncmp(&row->render[i], keywords[j], klen) &&
-                        is_separator(row->render[i + klen])) {
-                    enum editorHighlight keyword_type = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
-                    memset(&row->hl[i], keyword_type, klen);
-                    i += klen;
+        // k bytes of the comment end matched: follow the longest prefix of
+        // it that the text still ends in
+        for (int k = 0; multiline && k < syntax->mce_len; k++) {
+            int m = k + 1;
+            while (m > 0) {
+                m--;
+                if ((unsigned char) mce[m] == c && !strncmp(&mce[k - m], mce, m)) {
+                    m++;
                     break;
                 }
             }
-
-            // If keywords is not NULL, then the previous for-loop was
-            // broken out of which would mean a valid keyword was found.
-            // In this case, continue.
-            if (keywords[j] != NULL) {
-                prev_sep = 0;
-                continue;
+            struct editorDfaEdge e = {syntax->dfa_comment + m, HL_MLCOMMENT, DFA_EMIT};
+            if (m == syntax->mce_len) {
+                e.next = DFA_SEP;
+            } else if (k == 0 && m == 0) {
+                e.action = DFA_RUN;
             }
+            syntax->dfa[(syntax->dfa_comment + k) * 256 + c] = e;
         }
-
-        prev_sep = is_separator(c);
-        i++;
     }
 
-    int changed = (row->hl_open_comment != in_comment);
-    row->hl_open_comment = in_comment;
-    if (changed && row->idx + 1 < E.num_rows) {
-        editorUpdateSyntax(&E.row[row->idx + 1]);
+    for (int state = syntax->dfa_prefix; state < syntax->dfa_states; state++) {
+        // Find the text of this prefix again
+        int len = 0;
+        for (int d = 0; d < 2 && !len; d++) {
+            int n = strlen(starts[d] ? starts[d] : "");
+            for (int k = 1; k < n && !len; k++) {
+                if (editorDfaPrefixState(syntax, starts[d], k) == state) {
+                    memcpy(q, starts[d], k);
+                    len = k;
+                }
+            }
+        }
+        syntax->dfa_accept[state] = multiline && len == syntax->mcs_len &&
+                !strncmp(q, syntax->multiline_comment_start, len);
+        for (int c = 0; c < 256; c++) {
+            syntax->dfa[state * 256 + c] = editorDfaPrefixEdge(syntax, q, len, c);
+        }
     }
 }
 
-int editorSyntaxToColor(int hl) {
-    // m Command Color Table
-    // |        	| Normal 	| Bright 	|
-    // |--------	|--------	|--------	|
-    // | Black  	| 0      	| 8      	|
-    // | Red    	| 1      	| 9      	|
-    // | Green  	| 2      	| 10     	|
-    // | Yellow 	| 3      	| 11     	|
-    // | Blue   	| 4      	| 12     	|
-    // | Purple 	| 5      	| 13     	|
-    // | Cyan   	| 6      	| 14     	|
-    // | White  	| 7      	| 15     	|
+// Keep the longest ranges of bytes that take each state's DFA_RUN edges
+void editorCompileSkips(struct editorSyntax* syntax) {
+    syntax->dfa_skip = calloc(syntax->dfa_states, sizeof(struct editorSkip));
+    for (int state = 0; state < syntax->dfa_states; state++) {
+        struct editorDfaEdge* edges = &syntax->dfa[state * 256];
+        struct editorSkip* skip = &syntax->dfa_skip[state];
+        int c = 0;
+        while (c < 256) {
+            if (edges[c].action != DFA_RUN) {
+                c++;
+                continue;
+            }
+            int lo = c;
+            while (c < 256 && edges[c].action == DFA_RUN) {
+                c++;
+            }
 
-    switch (hl) {
-        case HL_COMMENT:
-        case HL_MLCOMMENT:
-            return 36;
-        case HL_KEYWORD1:
-            return 33;
-        case HL_KEYWORD2:
-            return 32;
-        case HL_STRING:
-            return 35;
-        case HL_NUMBER:
-            return 31;
-        case HL_MATCH:
-            return 34;
-        default:
-            return 37;
+            int k = skip->ranges;
+            if (k == EDI_SKIP_RANGES) {
+                // Full: replace the shortest, if this one is longer
+                k = 0;
+                for (int m = 1; m < EDI_SKIP_RANGES; m++) {
+                    if (skip->span[m] < skip->span[k]) {
+                        k = m;
+                    }
+                }
+                if (skip->span[k] >= c - 1 - lo) {
+                    continue;
+                }
+            } else {
+                skip->ranges++;
+            }
+            skip->lo[k] = lo;
+            skip->span[k] = c - 1 - lo;
+        }
+        for (int k = skip->ranges; k < EDI_SKIP_RANGES; k++) {
+            skip->lo[k] = skip->lo[0];
+            skip->span[k] = skip->span[0];
+        }
     }
 }
 
-void editorSelectSyntaxHighlight() {
-    E.syntax = NULL;
-    if (E.filename == NULL) {
-        return;
+// Where, from j, the first byte outside the skip ranges is, or limit. A
+// byte is in a range when, less lo, it is no more than span unsigned, and
+// min_epu8 is the unsigned compare SSE2 has.
+int editorSkipRun(const struct editorSkip* skip, const unsigned char* p, int j, int limit) {
+#ifdef __SSE2__
+    __m128i lo[EDI_SKIP_RANGES];
+    __m128i span[EDI_SKIP_RANGES];
+    for (int k = 0; k < EDI_SKIP_RANGES; k++) {
+        lo[k] = _mm_set1_epi8((char) skip->lo[k]);
+        span[k] = _mm_set1_epi8((char) skip->span[k]);
+    }
+    for (; j + 16 <= limit; j += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) &p[j]);
+        __m128i in = _mm_setzero_si128();
+        for (int k = 0; k < EDI_SKIP_RANGES; k++) {
+            __m128i d = _mm_sub_epi8(v, lo[k]);
+            in = _mm_or_si128(in, _mm_cmpeq_epi8(_mm_min_epu8(d, span[k]), d));
+        }
+        int out = ~_mm_movemask_epi8(in) & 0xFFFF;
+        if (out) {
+            return j + __builtin_ctz(out);
+        }
     }
+#endif
+    for (; j < limit; j++) {
+        int in = 0;
+        for (int k = 0; k < EDI_SKIP_RANGES; k++) {
+            in |= (unsigned char) (p[j] - skip->lo[k]) <= skip->span[k];
+        }
+        if (!in) {
+            return j;
+        }
+    }
+    return limit;
+}
 
-    char* ext = strrchr(E.filename, '.');
+// Build the lookup tables the highlighter uses for a syntax
+void editorCompileSyntax(struct editorSyntax* syntax) {
+    char* delims[] = {
+        syntax->singleline_comment_start,
+        syntax->multiline_comment_start,
+        syntax->multiline_comment_end
+    };
+
+    for (int c = 0; c < 256; c++) {
+        unsigned char cc = 0;
+        if (c < 0x80 && is_separator(c)) {
+            cc |= CC_SEPARATOR;
+        }
+        if ((syntax->flags & HL_HIGHLIGHT_NUMBERS) && isdigit(c)) {
+            cc |= CC_DIGIT;
+        }
+        if ((syntax->flags & HL_HIGHLIGHT_STRINGS) && c && strchr(syntax->quotes, c)) {
+            cc |= CC_QUOTE;
+        }
+        for (unsigned int j = 0; j < sizeof(delims) / sizeof(delims[0]); j++) {
+            if (delims[j] && (unsigned char) delims[j][0] == c) {
+                cc |= CC_COMMENT;
+            }
+        }
+        syntax->char_class[c] = cc;
+    }
 
-    // Loop through each editorSyntax struct in the HLDB array,
-    // and for each one, loop through each pattern in its file_match array.
-    // If the pattern starts with a '.', then it’s a file extension pattern,
-    // and so use strcmp() to see if the filename ends with that extension.
-    // If it’s not a file extension pattern, then just check to see if the
-    // pattern exists anywhere in the filename, using strstr().
-    // If the filename matched according to those rules, then set E.syntax
-    // to the current editorSyntax struct, and return.
-    for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
-        struct editorSyntax* s = &HLDB[j];
-        unsigned int i = 0;
-        while (s->file_match[i]) {
-            int is_ext = (s->file_match[i][0] == '.');
-            if ((is_ext && ext && !strcmp(ext, s->file_match[i])) ||
-                    (!is_ext && strstr(E.filename, s->file_match[i]))) {
-                E.syntax = s;
-
-                for (int file_row = 0; file_row < E.num_rows; file_row++) {
-                    editorUpdateSyntax(&E.row[file_row]);
+    int stops = 0;
+    for (int c = 1; c < 256; c++) {
+        if (syntax->char_class[c] & (CC_QUOTE | CC_COMMENT)) {
+            syntax->state_stops[stops++] = c;
+        }
+    }
+    syntax->state_stops[stops] = '\0';
+
+    syntax->scs_len = delims[0] ? strlen(delims[0]) : 0;
+    syntax->mcs_len = delims[1] ? strlen(delims[1]) : 0;
+    syntax->mce_len = delims[2] ? strlen(delims[2]) : 0;
+
+    editorCompileKeywords(syntax);
+    editorCompileDfa(syntax);
+    editorCompileSkips(syntax);
+    syntax->scan = editorSyntaxScanDfa;
+#ifdef EDI_LEXERS
+    if (syntax >= HLDB && syntax < &HLDB[HLDB_ENTRIES]) {
+        syntax->scan = editorLexers[syntax - HLDB];
+    }
+#endif
+    syntax->compiled = 1;
+}
+
+// Lexer state carried between highlighting steps. A state where all three
+// are "clean" (not in a string or comment, previous char a separator) is
+// the state at the start of a row outside of a multiline comment.
+struct editorHlState {
+    int in_string;
+    int in_comment;
+    int prev_sep;
+};
+
+// DFA state to start scanning render[i..] in
+int editorDfaStartState(struct editorSyntax* syntax, erow* row, int i, struct editorHlState* st) {
+    if (st->in_comment && syntax->dfa_pending > syntax->dfa_comment) {
+        return syntax->dfa_comment;
+    } else if (st->in_string && strchr(syntax->quotes, st->in_string)) {
+        return syntax->dfa_string + (strchr(syntax->quotes, st->in_string) - syntax->quotes);
+    } else if (!st->prev_sep && i > 0 && row->hl[i - 1] == HL_NUMBER) {
+        return DFA_NUMBER;
+    }
+    return st->prev_sep ? DFA_SEP : DFA_WORD;
+}
+
+// Store the DFA state scanning stopped in back into 'st'
+void editorDfaEndState(struct editorSyntax* syntax, int state, struct editorHlState* st) {
+    st->in_comment = state >= syntax->dfa_comment && state < syntax->dfa_prefix;
+    st->in_string = 0;
+    if (state >= syntax->dfa_string && state < syntax->dfa_comment) {
+        st->in_string = syntax->quotes[state - syntax->dfa_string];
+    }
+    st->prev_sep = state != DFA_WORD && state != DFA_NUMBER;
+}
+
+// Highlight render[i..] until at least 'limit', stopping only between
+// tokens, and return the index scanning stopped at. The caller owns
+// row->hl and 'st' so a row can be highlighted in several spans.
+int editorSyntaxScan(erow* row, int i, int limit, struct editorHlState* st) {
+    return E.syntax->scan(row, i, limit, st);
+}
+
+// editorSyntaxScan() by walking the syntax's DFA tables
+int editorSyntaxScanDfa(erow* row, int i, int limit, struct editorHlState* st) {
+    struct editorSyntax* syntax = E.syntax;
+    unsigned char* cls = syntax->char_class;
+    unsigned char* render = (unsigned char*) row->render;
+    unsigned char* hl = row->hl;
+    struct editorDfaEdge* dfa = syntax->dfa;
+    struct editorDfaEdge* edges = dfa;
+
+    int state = editorDfaStartState(syntax, row, i, st);
+
+    // Where the comment delimiter being matched started, and the state
+    // before it
+    int from = i;
+    int from_state = state;
+
+    // Delimiters are matched to the end even past 'limit'
+    while (i < limit || state >= syntax->dfa_pending) {
+        if (i >= row->rsize && state < syntax->dfa_prefix) {
+            // The row ends in part of a comment end
+            break;
+        }
+
+        struct editorDfaEdge e = edges[state * 256 + render[i]];
+        edges = dfa;
+        switch (e.action) {
+            case DFA_EMIT:
+                hl[i++] = e.hl;
+                state = e.next;
+                break;
+
+            case DFA_RUN: {
+                // The run goes on in e.next, whose DFA_RUN edges all lead
+                // back to it with the same class
+                struct editorDfaEdge* run = &dfa[e.next * 256];
+                int j = i + 1;
+                while (j < limit && run[render[j]].action == DFA_RUN) {
+                    j++;
+                    // Long enough to be worth skipping ahead in blocks
+                    if (j - i >= EDI_SKIP_AFTER) {
+                        j = editorSkipRun(&syntax->dfa_skip[e.next], render, j, limit);
+                    }
+                }
+                memset(&hl[i], e.hl, j - i);
+                i = j;
+                state = e.next;
+                break;
+            }
+
+            case DFA_KEYWORD: {
+                // The word runs up to the next separator; one longer than
+                // any keyword cannot be one
+                int max_len = syntax->keyword_max_len;
+                int len = 1;
+                while (len <= max_len && !(cls[render[i + len]] & CC_SEPARATOR)) {
+                    len++;
+                }
+                if (len <= max_len) {
+                    unsigned int h = editorKeywordHash((char*) &render[i], len, syntax->keyword_seed);
+                    struct editorKeyword* kw = &syntax->keyword_slots[h & syntax->keyword_mask];
+                    if (kw->word && kw->len == len && !memcmp(&render[i], kw->word, len)) {
+                        memset(&hl[i], kw->hl, len);
+                        i += len;
+                        state = DFA_WORD;
+                        break;
+                    }
+                }
+                hl[i++] = e.hl;
+                state = e.next;
+                break;
+            }
+
+            case DFA_ESCAPE:
+                hl[i] = HL_STRING;
+                if (i + 1 < row->rsize) {
+                    hl[++i] = HL_STRING;
+                }
+                i++;
+                break;
+
+            case DFA_PREFIX:
+                if (state < syntax->dfa_prefix) {
+                    from = i;
+                    from_state = state;
+                }
+                i++;
+                state = e.next;
+                break;
+
+            case DFA_FAIL:
+                if (syntax->dfa_accept[state]) {
+                    // The multiline start was there after all
+                    memset(&hl[from], HL_MLCOMMENT, syntax->mcs_len);
+                    i = from + syntax->mcs_len;
+                    state = syntax->dfa_comment;
+                } else {
+                    i = from;
+                    state = from_state;
+                    edges = syntax->dfa_alt;
+                }
+                break;
+
+            case DFA_SCS:
+                if (state < syntax->dfa_prefix) {
+                    from = i;
+                }
+                memset(&hl[from], HL_COMMENT, row->rsize - from);
+                st->in_string = 0;
+                st->in_comment = 0;
+                return row->rsize;
+
+            case DFA_MCS:
+                if (state < syntax->dfa_prefix) {
+                    from = i;
+                }
+                i++;
+                memset(&hl[from], HL_MLCOMMENT, i - from);
+                state = syntax->dfa_comment;
+                break;
+        }
+    }
+
+    editorDfaEndState(syntax, state, st);
+    return i;
+}
+
+#ifdef EDI_LEXERS
+#include "edi_lexers.h"
+#endif
+
+// Work out only whether a row ends inside a multiline comment, which is all
+// the rows after it depend on. Only quotes, escapes and comment delimiters
+// matter for that (keywords have none of them), so this skips everything
+// else and leaves hl alone.
+int editorSyntaxScanState(erow* row, int in_comment) {
+    struct editorSyntax* syntax = E.syntax;
+    unsigned char* cls = syntax->char_class;
+    char* p = row->render;
+    int n = row->rsize;
+
+    char* scs = syntax->singleline_comment_start;
+    char* mcs = syntax->multiline_comment_start;
+    char* mce = syntax->multiline_comment_end;
+    int multiline = syntax->mcs_len && syntax->mce_len;
+
+    char string_stops[3] = { '\\', 0, 0 };
+
+    int in_string = 0;
+    int i = 0;
+    while (i < n) {
+        if (in_comment) {
+            char* end = memmem(&p[i], n - i, mce, syntax->mce_len);
+            if (!end) {
+                return 1;
+            }
+            i = end - p + syntax->mce_len;
+            in_comment = 0;
+            continue;
+        }
+
+        // Jump to the next byte that can matter. render ends in a NUL, but
+        // a NUL in the text also stops the search, so step over that.
+        i += strcspn(&p[i], in_string ? string_stops : syntax->state_stops);
+        if (i >= n) {
+            break;
+        }
+        if (p[i] == '\0') {
+            i++;
+            continue;
+        }
+
+        if (in_string) {
+            if (p[i] == '\\' && i + 1 < n) {
+                i += 2;
+                continue;
+            }
+            if (p[i] == in_string) {
+                in_string = 0;
+            }
+            i++;
+            continue;
+        }
+
+        unsigned char cc = cls[(unsigned char) p[i]];
+        if (cc & CC_COMMENT) {
+            if (syntax->scs_len && !strncmp(&p[i], scs, syntax->scs_len)) {
+                return 0;
+            }
+            if (multiline && !strncmp(&p[i], mcs, syntax->mcs_len)) {
+                i += syntax->mcs_len;
+                in_comment = 1;
+                continue;
+            }
+        }
+        if (cc & CC_QUOTE) {
+            in_string = p[i];
+            string_stops[1] = p[i];
+        }
+        i++;
+    }
+
+    return in_comment;
+}
+
+// Rows from 'at' on can no longer be assumed to start in the right state
+void editorSyntaxInvalidate(int at) {
+    if (E.hl_frontier > at) {
+        E.hl_frontier = at;
+    }
+}
+
+// Store the row's end-of-line comment state. If it changed, the rows after
+// it have to be checked again before they are shown.
+void editorSyntaxSetOpenComment(erow* row, int in_comment) {
+    if (row->hl_open_comment != in_comment) {
+        editorSyntaxInvalidate(row->idx + 1);
+    }
+    row->hl_open_comment = in_comment;
+}
+
+// Comment state at the start of row 'at', valid once the frontier is past
+// the row before it
+int editorSyntaxStartState(int at) {
+    return (at > 0) ? E.row[at - 1].hl_open_comment : 0;
+}
+
+// Move the frontier up to row 'to'. Rows still starting in the state their
+// checkpoint has are skipped; only the others are scanned, and only for
+// their end state. With 'resync' set it stops at the first row skipped.
+// Gives up at E.hl_deadline if one is set; returns 0 if it did.
+int editorSyntaxWalk(int to, int resync) {
+    int batch = 1;
+    while (E.hl_frontier < to) {
+        if (E.hl_deadline && --batch == 0) {
+            if (editorNow() > E.hl_deadline) {
+                return 0;
+            }
+            batch = EDI_HL_BATCH;
+        }
+        erow* row = &E.row[E.hl_frontier];
+        int start = editorSyntaxStartState(E.hl_frontier);
+        if (row->hl_start_comment != start) {
+            row->hl_open_comment = editorSyntaxScanState(row, start);
+            row->hl_start_comment = start;
+            row->hl_ready = 0;
+            editorBracketTouch(row);
+        } else if (resync) {
+            return 1;
+        }
+        E.hl_frontier++;
+    }
+    return 1;
+}
+
+// Thread body for one chunk: editorSyntaxWalk() without the frontier,
+// chaining the chunk's rows from its assumed start state. Only the chunk's
+// own rows are written.
+void* editorSyntaxScanChunk(void* arg) {
+    struct editorHlChunk* chunk = arg;
+    int in_comment = chunk->start;
+    int cap = 0;
+    int r;
+    for (r = chunk->from; r < chunk->to; r++) {
+        if (E.hl_deadline && (r - chunk->from) % EDI_HL_BATCH == 0 && editorNow() > E.hl_deadline) {
+            break;
+        }
+        erow* row = &E.row[r];
+        if (row->hl_start_comment != in_comment) {
+            row->hl_open_comment = editorSyntaxScanState(row, in_comment);
+            row->hl_start_comment = in_comment;
+            row->hl_ready = 0;
+            if (row->br_ready) {
+                if (chunk->touched_len == cap) {
+                    cap = cap ? cap * 2 : 16;
+                    chunk->touched = realloc(chunk->touched, sizeof(int) * cap);
+                }
+                chunk->touched[chunk->touched_len++] = r;
+            }
+        }
+        in_comment = row->hl_open_comment;
+    }
+    chunk->done = r;
+    return NULL;
+}
+
+// Scan chunks of E.hl_chunks until none is left to take. Called by the
+// input thread and by the pool, with hl_pool_lock held if there is a pool.
+void editorHlPoolRun() {
+    while (E.hl_chunks_next < E.hl_chunks_len) {
+        struct editorHlChunk* chunk = &E.hl_chunks[E.hl_chunks_next++];
+        if (E.hl_pool_len) {
+            pthread_mutex_unlock(&E.hl_pool_lock);
+        }
+        editorSyntaxScanChunk(chunk);
+        if (E.hl_pool_len) {
+            pthread_mutex_lock(&E.hl_pool_lock);
+        }
+        if (--E.hl_chunks_left == 0 && E.hl_pool_len) {
+            pthread_cond_broadcast(&E.hl_pool_done);
+        }
+    }
+}
+
+// Threads to move the frontier with: one for each CPU online
+int editorHlThreads() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) {
+        return 1;
+    }
+    return (n > EDI_HL_THREADS) ? EDI_HL_THREADS : n;
+}
+
+// Move the frontier towards 'to' on E.hl_threads threads: this one and the
+// pool. The rows are split into chunks scanned at once, each but the first
+// as if it started outside any comment, which is almost always so. The frontier then goes
+// through the chunks in order. Where a chunk's guess was wrong its rows
+// are scanned again, but only up to the first one whose start state comes
+// out the same: its thread left the rest right. Returns 0 if the deadline
+// passed first.
+int editorSyntaxSpeculate(int to) {
+    int from = E.hl_frontier;
+    int n = (to - from) / EDI_HL_CHUNK;
+    if (n > E.hl_threads) {
+        n = E.hl_threads;
+    }
+    struct editorHlChunk chunks[EDI_HL_THREADS];
+    for (int k = 0; k < n; k++) {
+        struct editorHlChunk* chunk = &chunks[k];
+        chunk->from = from + (long) (to - from) * k / n;
+        chunk->to = from + (long) (to - from) * (k + 1) / n;
+        chunk->start = k ? 0 : editorSyntaxStartState(from);
+        chunk->touched = NULL;
+        chunk->touched_len = 0;
+    }
+
+    // Hand the chunks to the pool and take some too, until all are done.
+    // Without a pool (or with fewer threads than chunks) this thread
+    // scans the rest.
+    if (E.hl_pool_len) {
+        pthread_mutex_lock(&E.hl_pool_lock);
+    }
+    E.hl_chunks = chunks;
+    E.hl_chunks_len = n;
+    E.hl_chunks_next = 0;
+    E.hl_chunks_left = n;
+    if (E.hl_pool_len) {
+        pthread_cond_broadcast(&E.hl_pool_cond);
+    }
+    editorHlPoolRun();
+    if (E.hl_pool_len) {
+        while (E.hl_chunks_left > 0) {
+            pthread_cond_wait(&E.hl_pool_done, &E.hl_pool_lock);
+        }
+    }
+    E.hl_chunks = NULL;
+    E.hl_chunks_len = 0;
+    E.hl_chunks_next = 0;
+    if (E.hl_pool_len) {
+        pthread_mutex_unlock(&E.hl_pool_lock);
+    }
+
+    E.stats.hl_chunks += n;
+    for (int k = 0; k < n; k++) {
+        for (int t = 0; t < chunks[k].touched_len; t++) {
+            editorBracketTouch(&E.row[chunks[k].touched[t]]);
+        }
+        free(chunks[k].touched);
+    }
+
+    for (int k = 0; k < n; k++) {
+        struct editorHlChunk* chunk = &chunks[k];
+        if (chunk->start != editorSyntaxStartState(chunk->from)) {
+            E.stats.hl_chunks_wrong++;
+            if (!editorSyntaxWalk(chunk->done, 1)) {
+                return 0;
+            }
+        }
+        if (E.hl_frontier < chunk->done) {
+            E.hl_frontier = chunk->done;
+        }
+        if (chunk->done < chunk->to) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Move the frontier up to row 'to', on several threads if it is far.
+// Gives up at E.hl_deadline if one is set; returns whether the frontier
+// got there.
+int editorSyntaxAdvance(int to) {
+    if (to > E.num_rows) {
+        to = E.num_rows;
+    }
+    if (E.hl_threads > 1 && to - E.hl_frontier >= 2 * EDI_HL_CHUNK && !editorSyntaxSpeculate(to)) {
+        return 0;
+    }
+    return editorSyntaxWalk(to, 0);
+}
+
+// Runs of hl[0, len) if they take less memory than hl itself, else NULL.
+// Runs end where a byte differs from the one before, which SSE2 finds 16
+// bytes at a time.
+struct editorHlRun* editorHlRuns(const unsigned char* hl, int len, int* nruns) {
+    int max = (len - 1) / (int) sizeof(struct editorHlRun);
+    if (max <= 0) {
+        return NULL;
+    }
+    // Most rows are short: build their runs on the stack and allocate once
+    struct editorHlRun local[64];
+    struct editorHlRun* runs = (max <= 64) ? local : malloc(sizeof(struct editorHlRun) * max);
+    int n = 0;
+    int start = 0;
+    int i = 1;
+#ifdef __SSE2__
+    for (; i + 16 <= len; i += 16) {
+        __m128i same = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) &hl[i]),
+                                      _mm_loadu_si128((const __m128i*) &hl[i - 1]));
+        unsigned int ends = ~_mm_movemask_epi8(same) & 0xFFFF;
+        while (ends) {
+            int end = i + __builtin_ctz(ends);
+            ends &= ends - 1;
+            if (n == max - 1) {
+                if (runs != local) {
+                    free(runs);
+                }
+                return NULL;
+            }
+            runs[n].start = start;
+            runs[n].len = end - start;
+            runs[n++].hl = hl[start];
+            start = end;
+        }
+    }
+#endif
+    for (; i < len; i++) {
+        if (hl[i] != hl[i - 1]) {
+            if (n == max - 1) {
+                if (runs != local) {
+                    free(runs);
+                }
+                return NULL;
+            }
+            runs[n].start = start;
+            runs[n].len = i - start;
+            runs[n++].hl = hl[start];
+            start = i;
+        }
+    }
+    runs[n].start = start;
+    runs[n].len = len - start;
+    runs[n++].hl = hl[start];
+
+    *nruns = n;
+    if (runs == local) {
+        runs = malloc(sizeof(struct editorHlRun) * n);
+        memcpy(runs, local, sizeof(struct editorHlRun) * n);
+        return runs;
+    }
+    return realloc(runs, sizeof(struct editorHlRun) * n);
+}
+
+void editorHlFree(erow* row) {
+    free(row->hl);
+    free(row->hl_runs);
+    row->hl = NULL;
+    row->hl_runs = NULL;
+    row->hl_nruns = 0;
+}
+
+// Index of the run covering render[i]
+int editorHlFindRun(erow* row, int i) {
+    int lo = 0;
+    int hi = row->hl_nruns - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (row->hl_runs[mid].start <= i) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+unsigned char editorHlAt(erow* row, int i) {
+    return row->hl_runs ? row->hl_runs[editorHlFindRun(row, i)].hl : row->hl[i];
+}
+
+// Copy the highlighting of render[start, start + len) to dst
+void editorHlCopy(erow* row, int start, int len, unsigned char* dst) {
+    if (row->hl_runs == NULL) {
+        memcpy(dst, &row->hl[start], len);
+        return;
+    }
+    int end = start + len;
+    int i = start;
+    for (int k = editorHlFindRun(row, start); i < end; k++) {
+        struct editorHlRun* run = &row->hl_runs[k];
+        int stop = run->start + run->len;
+        if (stop > end) {
+            stop = end;
+        }
+        memset(&dst[i - start], run->hl, stop - i);
+        i = stop;
+    }
+}
+
+// Give the row its highlighting byte by byte, to scan into or patch
+void editorHlDense(erow* row) {
+    if (row->hl_runs) {
+        unsigned char* hl = malloc(row->rsize + 1);
+        editorHlCopy(row, 0, row->rsize, hl);
+        editorHlFree(row);
+        row->hl = hl;
+    } else if (row->hl == NULL) {
+        row->hl = malloc(row->rsize + 1);
+    }
+}
+
+// Give the row bytes to highlight it into from scratch: its own, if it
+// has them, else E.hl_scratch until editorHlCompact()
+void editorHlScratch(erow* row) {
+    if (row->hl_runs) {
+        editorHlFree(row);
+    }
+    if (row->hl == NULL) {
+        if (E.hl_scratch_cap < row->rsize + 1) {
+            E.hl_scratch_cap = row->rsize + 1;
+            E.hl_scratch = realloc(E.hl_scratch, E.hl_scratch_cap);
+        }
+        row->hl = E.hl_scratch;
+    }
+}
+
+// Store a freshly highlighted row as runs if that is smaller, else as
+// bytes of its own
+void editorHlCompact(erow* row) {
+    int n;
+    struct editorHlRun* runs = editorHlRuns(row->hl, row->rsize, &n);
+    if (runs) {
+        if (row->hl != E.hl_scratch) {
+            free(row->hl);
+        }
+        row->hl = NULL;
+        row->hl_runs = runs;
+        row->hl_nruns = n;
+    } else if (row->hl == E.hl_scratch) {
+        row->hl = malloc(row->rsize + 1);
+        memcpy(row->hl, E.hl_scratch, row->rsize);
+    }
+}
+
+// Bytes held for highlighting: as stored, and as one byte per render byte
+void editorHlMemory(long* stored, long* dense) {
+    *stored = 0;
+    *dense = 0;
+    for (int r = 0; r < E.num_rows; r++) {
+        erow* row = &E.row[r];
+        *stored += (row->hl ? row->rsize : 0) + row->hl_nruns * sizeof(struct editorHlRun);
+        *dense += row->rsize;
+    }
+}
+
+// Make sure a row's hl is up to date before it is shown or searched. If
+// the frontier can't reach it in time, the row is highlighted as starting
+// in the state the row above it last ended in: shown rows are contiguous,
+// so only the first one shown can be wrong, and only until idle time
+// catches the frontier up (editorSyntaxIdle).
+void editorSyntaxEnsure(erow* row) {
+    if (E.syntax == NULL) {
+        if (!row->hl_ready) {
+            editorHlScratch(row);
+            memset(row->hl, HL_NORMAL, row->rsize);
+            row->hl_ready = 1;
+            editorHlCompact(row);
+            editorBracketTouch(row);
+        }
+        return;
+    }
+
+    if (!editorSyntaxAdvance(row->idx) && row->idx > E.hl_provisional) {
+        E.hl_provisional = row->idx;
+    }
+    int start = editorSyntaxStartState(row->idx);
+    if (row->hl_ready && row->hl_start_comment == start) {
+        return;
+    }
+
+    struct editorHlState st = {0, start, 1};
+    editorHlScratch(row);
+    editorSyntaxScan(row, 0, row->rsize, &st);
+    editorHlCompact(row);
+    row->hl_start_comment = start;
+    row->hl_ready = 1;
+    editorBracketTouch(row);
+    editorSyntaxSetOpenComment(row, st.in_comment);
+}
+
+// Called while waiting for input: move the frontier on in EDI_HL_BUDGET
+// slices until a key comes in, and redraw once the rows shown
+// provisionally have been checked.
+void editorSyntaxIdle() {
+    if (E.syntax == NULL) {
+        return;
+    }
+    struct pollfd in = {STDIN_FILENO, POLLIN, 0};
+    while (E.hl_frontier < E.num_rows && poll(&in, 1, 0) == 0) {
+        E.hl_deadline = editorNow() + EDI_HL_BUDGET;
+        editorSyntaxAdvance(E.num_rows);
+        E.hl_deadline = 0;
+        if (E.hl_provisional >= 0 && E.hl_frontier > E.hl_provisional) {
+            E.hl_provisional = -1;
+            editorRefreshScreen();
+        }
+    }
+}
+
+// The row's text changed all over; it is highlighted again when next shown
+void editorUpdateSyntax(erow* row) {
+    editorHlFree(row);
+    editorBracketTouch(row);
+    row->hl_epoch = ++E.hl_epoch;
+    row->hl_start_comment = -1;
+    row->hl_ready = 0;
+    editorSyntaxInvalidate(row->idx);
+}
+
+// Rehighlight a row whose render changed only in [start, end) (end == start
+// for a pure deletion), with hl outside that range already shifted into its
+// new position. Scanning restarts just after a plain separator before the
+// edit, where the lexer state is known to be clean, and stops as soon as
+// it reaches another plain separator that was also plain before the edit:
+// from there on the old highlighting is still correct.
+void editorUpdateSyntaxFrom(erow* row, int start, int end) {
+    // Patching needs the rest of hl to be right, so a row not highlighted
+    // (for the state it starts in now) is simply redone when next shown
+    if (!row->hl_ready || (E.syntax && (row->idx > E.hl_frontier ||
+            row->hl_start_comment != editorSyntaxStartState(row->idx)))) {
+        editorUpdateSyntax(row);
+        return;
+    }
+
+    row->hl_epoch = ++E.hl_epoch;
+    editorBracketTouch(row);
+    if (E.syntax == NULL) {
+        memset(&row->hl[start], HL_NORMAL, end - start);
+        return;
+    }
+
+    // A comment delimiter starting this far back can still overlap the edit
+    int reach = 1;
+    char* delims[] = {
+        E.syntax->singleline_comment_start,
+        E.syntax->multiline_comment_start,
+        E.syntax->multiline_comment_end
+    };
+    for (unsigned int j = 0; j < sizeof(delims) / sizeof(delims[0]); j++) {
+        int len = delims[j] ? strlen(delims[j]) : 0;
+        if (len > reach) {
+            reach = len;
+        }
+    }
+
+    unsigned char* cls = E.syntax->char_class;
+    struct editorHlState st = {0, 0, 1};
+    int i = start - reach;
+    while (i > 0 && !(row->hl[i - 1] == HL_NORMAL && (cls[(unsigned char) row->render[i - 1]] & CC_SEPARATOR))) {
+        i--;
+    }
+    if (i <= 0) {
+        i = 0;
+        st.in_comment = row->hl_start_comment;
+    }
+
+    int limit = end + reach;
+    while (i < row->rsize) {
+        if (limit > row->rsize) {
+            limit = row->rsize;
+        }
+        unsigned char old_hl = row->hl[limit - 1];
+
+        i = editorSyntaxScan(row, i, limit, &st);
+
+        if (i == limit && i < row->rsize && old_hl == HL_NORMAL &&
+                row->hl[i - 1] == HL_NORMAL && (cls[(unsigned char) row->render[i - 1]] & CC_SEPARATOR)) {
+            return;
+        }
+        limit = i + 64;
+    }
+
+    editorSyntaxSetOpenComment(row, st.in_comment);
+}
+
+int editorSyntaxToColor(int hl) {
+    // m Command Color Table
+    // |        	| Normal 	| Bright 	|
+    // |--------	|--------	|--------	|
+    // | Black  	| 0      	| 8      	|
+    // | Red    	| 1      	| 9      	|
+    // | Green  	| 2      	| 10     	|
+    // | Yellow 	| 3      	| 11     	|
+    // | Blue   	| 4      	| 12     	|
+    // | Purple 	| 5      	| 13     	|
+    // | Cyan   	| 6      	| 14     	|
+    // | White  	| 7      	| 15     	|
+
+    switch (hl) {
+        case HL_COMMENT:
+        case HL_MLCOMMENT:
+            return 36;
+        case HL_KEYWORD1:
+            return 33;
+        case HL_KEYWORD2:
+            return 32;
+        case HL_STRING:
+            return 35;
+        case HL_NUMBER:
+            return 31;
+        case HL_MATCH:
+            return 34;
+        case HL_BRACKET:
+            return 93;
+        default:
+            return 37;
+    }
+}
+
+void editorIndexAdd(const char* key, int len, char kind, struct editorSyntax* syntax) {
+    unsigned int i = editorKeywordHash(key, len, kind) & HLDB_index_mask;
+    while (HLDB_index[i].key) {
+        // The first syntax to claim a key keeps it
+        if (HLDB_index[i].kind == kind && HLDB_index[i].len == len &&
+                !memcmp(HLDB_index[i].key, key, len)) {
+            return;
+        }
+        i = (i + 1) & HLDB_index_mask;
+    }
+    HLDB_index[i].key = key;
+    HLDB_index[i].len = len;
+    HLDB_index[i].kind = kind;
+    HLDB_index[i].syntax = syntax;
+}
+
+// Build HLDB_index from HLDB_loaded, then HLDB, so a syntax file can take
+// over the files of a built-in syntax
+void editorIndexSyntaxes() {
+    unsigned int keys = 0;
+    for (unsigned int j = 0; j < HLDB_loaded_entries + HLDB_ENTRIES; j++) {
+        struct editorSyntax* s = (j < HLDB_loaded_entries) ? &HLDB_loaded[j] : &HLDB[j - HLDB_loaded_entries];
+        keys++;
+        for (int i = 0; s->file_match[i]; i++) {
+            keys++;
+        }
+    }
+
+    unsigned int size = 1;
+    while (size < 2 * keys) {
+        size *= 2;
+    }
+    HLDB_index = calloc(size, sizeof(struct editorSyntaxKey));
+    HLDB_index_mask = size - 1;
+
+    for (unsigned int j = 0; j < HLDB_loaded_entries + HLDB_ENTRIES; j++) {
+        struct editorSyntax* s = (j < HLDB_loaded_entries) ? &HLDB_loaded[j] : &HLDB[j - HLDB_loaded_entries];
+        editorIndexAdd(s->file_type, strlen(s->file_type), '=', s);
+        for (int i = 0; s->file_match[i]; i++) {
+            const char* pattern = s->file_match[i];
+            if (pattern[0] == '.') {
+                editorIndexAdd(pattern, strlen(pattern), '.', s);
+            } else if (pattern[0] == '#' && pattern[1] == '!') {
+                editorIndexAdd(&pattern[2], strlen(pattern) - 2, '!', s);
+            } else {
+                editorIndexAdd(pattern, strlen(pattern), 'n', s);
+            }
+        }
+    }
+}
+
+struct editorSyntax* editorFindSyntax(const char* key, int len, char kind) {
+    unsigned int i = editorKeywordHash(key, len, kind) & HLDB_index_mask;
+    while (HLDB_index[i].key) {
+        if (HLDB_index[i].kind == kind && HLDB_index[i].len == len &&
+                !memcmp(HLDB_index[i].key, key, len)) {
+            return HLDB_index[i].syntax;
+        }
+        i = (i + 1) & HLDB_index_mask;
+    }
+    return NULL;
+}
+
+// The syntax a modeline names: a file type, or failing that an extension,
+// so "ft=cpp" finds the syntax for .cpp files
+struct editorSyntax* editorFindSyntaxNamed(const char* name, int len) {
+    struct editorSyntax* s = editorFindSyntax(name, len, '=');
+    if (s == NULL && len < 32) {
+        char ext[33] = ".";
+        memcpy(&ext[1], name, len);
+        s = editorFindSyntax(ext, len + 1, '.');
+    }
+    return s;
+}
+
+int is_modeline_char(int c) {
+    return isalnum(c) || c == '_' || c == '-' || c == '+' || c == '.';
+}
+
+// The syntax a vim modeline ("vim: set ft=python:", "vi: syntax=sh") or an
+// Emacs one ("-*- mode: ruby -*-", "-*- perl -*-") in the row asks for
+struct editorSyntax* editorSniffModeline(erow* row) {
+    const char* line = row->chars;
+    const char* p = strstr(line, "-*-");
+    if (p) {
+        p += 3;
+        const char* end = strstr(p, "-*-");
+        if (end) {
+            const char* mode = strstr(p, "mode:");
+            if (mode && mode < end) {
+                p = mode + 5;
+            } else if (memchr(p, ':', end - p)) {
+                return NULL;
+            }
+            while (p < end && isspace((unsigned char) *p)) {
+                p++;
+            }
+            const char* name = p;
+            while (p < end && is_modeline_char((unsigned char) *p)) {
+                p++;
+            }
+            char lower[32];
+            int len = p - name;
+            if (len == 0 || len > (int) sizeof(lower)) {
+                return NULL;
+            }
+            for (int i = 0; i < len; i++) {
+                lower[i] = tolower((unsigned char) name[i]);
+            }
+            return editorFindSyntaxNamed(lower, len);
+        }
+    }
+
+    const char* markers[] = { "vim:", "vi:", "ex:" };
+    for (unsigned int m = 0; m < sizeof(markers) / sizeof(markers[0]); m++) {
+        for (p = strstr(line, markers[m]); p; p = strstr(p + 1, markers[m])) {
+            if (p != line && !isspace((unsigned char) p[-1])) {
+                continue;
+            }
+            const char* options[] = { "ft=", "filetype=", "syn=", "syntax=" };
+            for (unsigned int o = 0; o < sizeof(options) / sizeof(options[0]); o++) {
+                for (const char* opt = strstr(p, options[o]); opt; opt = strstr(opt + 1, options[o])) {
+                    if (!isspace((unsigned char) opt[-1]) && opt[-1] != ':') {
+                        continue;
+                    }
+                    const char* name = opt + strlen(options[o]);
+                    int len = 0;
+                    while (is_modeline_char((unsigned char) name[len])) {
+                        len++;
+                    }
+                    if (len) {
+                        return editorFindSyntaxNamed(name, len);
+                    }
                 }
+            }
+        }
+    }
+    return NULL;
+}
 
-                return;
+// The syntax for the interpreter on a "#!" line: the base name of the
+// command, or of the one env runs, tried as is and then without a version
+// ("python3.11" is python)
+struct editorSyntax* editorSniffShebang(erow* row) {
+    if (row->size < 2 || row->chars[0] != '#' || row->chars[1] != '!') {
+        return NULL;
+    }
+
+    const char* p = &row->chars[2];
+    const char* word;
+    int len;
+    while (1) {
+        while (*p == ' ' || *p == '\t') {
+            p++;
+        }
+        word = p;
+        while (*p && !isspace((unsigned char) *p)) {
+            if (*p == '/') {
+                word = p + 1;
             }
-            i++;
+            p++;
+        }
+        len = p - word;
+        if (len == 0) {
+            return NULL;
+        }
+        // Skip env, its options and its variable settings
+        if (!(len == 3 && !memcmp(word, "env", 3)) && word[0] != '-' && !memchr(word, '=', len)) {
+            break;
         }
     }
- }
 
-// ******** ROW OPERATIONS ********
+    struct editorSyntax* s = editorFindSyntax(word, len, '!');
+    if (s == NULL) {
+        while (len > 0 && (isdigit((unsigned char) word[len - 1]) || word[len - 1] == '.')) {
+            len--;
+        }
+        s = editorFindSyntax(word, len, '!');
+    }
+    return s;
+}
 
-int editorRowCxToRx(erow* row, int cx) {
-    int rx = 0;
-    for (int j = 0; j < cx; j++) {
-        if (row->chars[j] == '\t') {
-            rx += (EDI_TAB_STOP - 1) - (rx % EDI_TAB_STOP);
+// Set E.syntax for the file, leaving the rows as they are
+void editorDetectSyntax() {
+    E.syntax = NULL;
+    if (E.filename == NULL) {
+        return;
+    }
+    if (HLDB_index == NULL) {
+        editorIndexSyntaxes();
+    }
+
+    // A modeline overrides everything. Then the base name is looked up
+    // (for the likes of Makefile), then the extension, and last, for
+    // scripts without one, the #! line.
+    struct editorSyntax* s = NULL;
+    for (int file_row = 0; !s && file_row < E.num_rows && file_row < EDI_MODELINES; file_row++) {
+        s = editorSniffModeline(&E.row[file_row]);
+    }
+    int last = E.num_rows - EDI_MODELINES;
+    for (int file_row = last > EDI_MODELINES ? last : EDI_MODELINES; !s && file_row < E.num_rows; file_row++) {
+        s = editorSniffModeline(&E.row[file_row]);
+    }
+
+    const char* base = strrchr(E.filename, '/');
+    base = base ? base + 1 : E.filename;
+    if (s == NULL) {
+        s = editorFindSyntax(base, strlen(base), 'n');
+    }
+    const char* ext = strrchr(base, '.');
+    if (s == NULL && ext) {
+        s = editorFindSyntax(ext, strlen(ext), '.');
+    }
+    if (s == NULL && E.num_rows > 0) {
+        s = editorSniffShebang(&E.row[0]);
+    }
+
+    if (s) {
+        E.syntax = s;
+        if (!s->compiled) {
+            editorCompileSyntax(s);
         }
-        rx++;
     }
+}
 
-    return rx;
+void editorSelectSyntaxHighlight() {
+    // Whatever the syntax ends up being, rows are highlighted for it when
+    // next shown. Nothing the worker did for the old one is wanted.
+    editorHlWorkerSync();
+    E.hl_frontier = 0;
+    for (int file_row = 0; file_row < E.num_rows; file_row++) {
+        E.row[file_row].hl_start_comment = -1;
+        E.row[file_row].hl_ready = 0;
+        E.row[file_row].br_ready = 0;
+    }
+    editorBracketInvalidate(0);
+    editorDetectSyntax();
 }
 
-int editorRowRxToCx(erow *row, int rx) {
-    int curr_rx = 0;
-    int cx;
-    for (cx = 0; cx < row->size; cx++) {
-        if (row->chars[cx] == '\t') {
-            curr_rx += (EDI_TAB_STOP - 1) - (curr_rx % EDI_TAB_STOP);
+// Add a copy of 'word' (followed by 'suffix') to a NULL terminated list
+char** editorListAppend(char** list, const char* word, const char* suffix) {
+    int n = 0;
+    while (list[n]) {
+        n++;
+    }
+    list = realloc(list, sizeof(char*) * (n + 2));
+    list[n] = malloc(strlen(word) + strlen(suffix) + 1);
+    strcpy(list[n], word);
+    strcat(list[n], suffix);
+    list[n + 1] = NULL;
+    return list;
+}
+
+// Read a syntax file into HLDB_loaded. Each line is a directive followed
+// by its arguments, separated by blanks, or a comment starting with '#':
+//
+//   filetype <name>            starts a new syntax
+//   match <.ext|name|#!cmd>... files it is for, as in HLDB
+//   keywords <word>...         highlighted as HL_KEYWORD1
+//   types <word>...            highlighted as HL_KEYWORD2
+//   comment <start>            single line comment
+//   multiline <start> <end>    multiline comment
+//   strings <quote chars>      highlight strings between these quotes
+//   numbers                    highlight numbers
+//
+// Lines that can't be used are skipped and the first such problem is
+// shown in the status bar.
+void editorLoadSyntaxFile(const char* path) {
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        editorSetStatusMessage("Can't read syntax file %s: %s", path, strerror(errno));
+        return;
+    }
+
+    struct editorSyntax* s = NULL;
+    char* line = NULL;
+    size_t line_cap = 0;
+    int line_no = 0;
+    const char* problem = NULL;
+    int problem_line = 0;
+    while (getline(&line, &line_cap, fp) != -1) {
+        line_no++;
+        char* save;
+        char* directive = strtok_r(line, " \t\r\n", &save);
+        if (directive == NULL || directive[0] == '#') {
+            continue;
+        }
+
+        char* args[3];
+        int n = 0;
+        char* arg;
+        const char* error = NULL;
+        if (!strcmp(directive, "filetype")) {
+            arg = strtok_r(NULL, " \t\r\n", &save);
+            if (arg == NULL) {
+                error = "filetype needs a name";
+            } else {
+                HLDB_loaded = realloc(HLDB_loaded, sizeof(struct editorSyntax) * (HLDB_loaded_entries + 1));
+                s = &HLDB_loaded[HLDB_loaded_entries++];
+                memset(s, 0, sizeof(struct editorSyntax));
+                s->file_type = strdup(arg);
+                s->file_match = calloc(1, sizeof(char*));
+                s->keywords = calloc(1, sizeof(char*));
+            }
+        } else if (s == NULL) {
+            error = "no filetype yet";
+        } else if (!strcmp(directive, "match") || !strcmp(directive, "keywords") ||
+                !strcmp(directive, "types")) {
+            while ((arg = strtok_r(NULL, " \t\r\n", &save))) {
+                if (directive[0] == 'm') {
+                    s->file_match = editorListAppend(s->file_match, arg, "");
+                } else {
+                    s->keywords = editorListAppend(s->keywords, arg, directive[0] == 't' ? "|" : "");
+                }
+            }
+        } else if (!strcmp(directive, "comment") || !strcmp(directive, "multiline") ||
+                !strcmp(directive, "strings")) {
+            int want = (directive[0] == 'm') ? 2 : 1;
+            while (n < 3 && (arg = strtok_r(NULL, " \t\r\n", &save))) {
+                args[n++] = arg;
+            }
+            if (n != want) {
+                error = "wrong number of arguments";
+            } else if (strlen(args[0]) > EDI_DELIM_MAX || (n == 2 && strlen(args[1]) > EDI_DELIM_MAX)) {
+                error = "delimiter too long";
+            } else if (directive[0] == 'c') {
+                s->singleline_comment_start = strdup(args[0]);
+            } else if (directive[0] == 'm') {
+                s->multiline_comment_start = strdup(args[0]);
+                s->multiline_comment_end = strdup(args[1]);
+            } else if (strlen(args[0]) > EDI_QUOTES_MAX) {
+                error = "too many quote chars";
+            } else if (strchr(args[0], '\\')) {
+                error = "a backslash can't be a quote";
+            } else {
+                s->quotes = strdup(args[0]);
+                s->flags |= HL_HIGHLIGHT_STRINGS;
+            }
+        } else if (!strcmp(directive, "numbers")) {
+            s->flags |= HL_HIGHLIGHT_NUMBERS;
+        } else {
+            error = "unknown directive";
+        }
+
+        if (error && !problem) {
+            problem = error;
+            problem_line = line_no;
+        }
+    }
+    free(line);
+    fclose(fp);
+
+    if (problem) {
+        editorSetStatusMessage("%s:%d: %s", path, problem_line, problem);
+    }
+}
+
+int editorIsSyntaxFile(const struct dirent* entry) {
+    int len = strlen(entry->d_name);
+    return len > 7 && !strcmp(&entry->d_name[len - 7], ".syntax");
+}
+
+// Load every *.syntax file in $EDI_SYNTAX_DIR, or ~/.edi/syntax if that
+// isn't set, in name order
+void editorLoadSyntaxFiles() {
+    char dir[PATH_MAX];
+    if (getenv("EDI_SYNTAX_DIR")) {
+        snprintf(dir, sizeof(dir), "%s", getenv("EDI_SYNTAX_DIR"));
+    } else if (getenv("HOME")) {
+        snprintf(dir, sizeof(dir), "%s/.edi/syntax", getenv("HOME"));
+    } else {
+        return;
+    }
+
+    struct dirent** names;
+    int n = scandir(dir, &names, editorIsSyntaxFile, alphasort);
+    if (n < 0) {
+        return;
+    }
+    for (int k = 0; k < n; k++) {
+        char path[PATH_MAX + sizeof(names[k]->d_name) + 1];
+        snprintf(path, sizeof(path), "%s/%s", dir, names[k]->d_name);
+        editorLoadSyntaxFile(path);
+        free(names[k]);
+    }
+    free(names);
+}
+
+// ******** UTF-8 ********
+
+// Codepoint ranges taking no column (combining marks, zero width spaces and
+// joiners, variation selectors) and two columns (East Asian Wide and
+// Fullwidth), each sorted for a binary search
+const unsigned int UTF8_zero_width[][2] = {
+        {0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD}, {0x05BF, 0x05BF},
+        {0x05C1, 0x05C2}, {0x05C4, 0x05C5}, {0x05C7, 0x05C7}, {0x0610, 0x061A},
+        {0x064B, 0x065F}, {0x0670, 0x0670}, {0x06D6, 0x06DC}, {0x06DF, 0x06E4},
+        {0x06E7, 0x06E8}, {0x06EA, 0x06ED}, {0x0900, 0x0902}, {0x093A, 0x093A},
+        {0x093C, 0x093C}, {0x0941, 0x0948}, {0x094D, 0x094D}, {0x0951, 0x0957},
+        {0x0E31, 0x0E31}, {0x0E34, 0x0E3A}, {0x0E47, 0x0E4E}, {0x1160, 0x11FF},
+        {0x1AB0, 0x1AFF}, {0x1DC0, 0x1DFF}, {0x200B, 0x200F}, {0x202A, 0x202E},
+        {0x2060, 0x2064}, {0x20D0, 0x20FF}, {0xFE00, 0xFE0F}, {0xFE20, 0xFE2F},
+        {0xFEFF, 0xFEFF}, {0xE0100, 0xE01EF}
+};
+
+const unsigned int UTF8_wide[][2] = {
+        {0x1100, 0x115F}, {0x231A, 0x231B}, {0x2329, 0x232A}, {0x23E9, 0x23EC},
+        {0x23F0, 0x23F0}, {0x23F3, 0x23F3}, {0x25FD, 0x25FE}, {0x2614, 0x2615},
+        {0x2648, 0x2653}, {0x267F, 0x267F}, {0x2693, 0x2693}, {0x26A1, 0x26A1},
+        {0x26AA, 0x26AB}, {0x26BD, 0x26BE}, {0x26C4, 0x26C5}, {0x26CE, 0x26CE},
+        {0x26D4, 0x26D4}, {0x26EA, 0x26EA}, {0x26F2, 0x26F3}, {0x26F5, 0x26F5},
+        {0x26FA, 0x26FA}, {0x26FD, 0x26FD}, {0x2705, 0x2705}, {0x270A, 0x270B},
+        {0x2728, 0x2728}, {0x274C, 0x274C}, {0x274E, 0x274E}, {0x2753, 0x2755},
+        {0x2757, 0x2757}, {0x2795, 0x2797}, {0x27B0, 0x27B0}, {0x27BF, 0x27BF},
+        {0x2B1B, 0x2B1C}, {0x2B50, 0x2B50}, {0x2B55, 0x2B55}, {0x2E80, 0x303E},
+        {0x3041, 0x33FF}, {0x3400, 0x4DBF}, {0x4E00, 0x9FFF}, {0xA000, 0xA4CF},
+        {0xA960, 0xA97F}, {0xAC00, 0xD7A3}, {0xF900, 0xFAFF}, {0xFE10, 0xFE19},
+        {0xFE30, 0xFE6F}, {0xFF00, 0xFF60}, {0xFFE0, 0xFFE6}, {0x16FE0, 0x16FE4},
+        {0x17000, 0x18AFF}, {0x1B000, 0x1B2FF}, {0x1F004, 0x1F004}, {0x1F0CF, 0x1F0CF},
+        {0x1F18E, 0x1F18E}, {0x1F191, 0x1F19A}, {0x1F200, 0x1F202}, {0x1F210, 0x1F23B},
+        {0x1F240, 0x1F248}, {0x1F250, 0x1F251}, {0x1F260, 0x1F265}, {0x1F300, 0x1F64F},
+        {0x1F680, 0x1F6FF}, {0x1F7E0, 0x1F7EB}, {0x1F90C, 0x1F9FF}, {0x1FA70, 0x1FAFF},
+        {0x20000, 0x2FFFD}, {0x30000, 0x3FFFD}
+};
+
+// Widths of BMP codepoints looked up so far, plus one (0 is not looked up)
+unsigned char UTF8_width_cache[0x10000];
+
+// Decode the sequence starting at s, at most len bytes long, and return its
+// length. A byte that does not start a valid sequence decodes on its own
+// to EDI_UTF8_INVALID.
+int editorUtf8Decode(const char* s, int len, unsigned int* cp) {
+    const unsigned char* u = (const unsigned char*) s;
+    int n;
+    unsigned int c;
+    unsigned int min;
+
+    if (u[0] < 0x80) {
+        *cp = u[0];
+        return 1;
+    } else if ((u[0] & 0xE0) == 0xC0) {
+        n = 2;
+        c = u[0] & 0x1F;
+        min = 0x80;
+    } else if ((u[0] & 0xF0) == 0xE0) {
+        n = 3;
+        c = u[0] & 0x0F;
+        min = 0x800;
+    } else if ((u[0] & 0xF8) == 0xF0) {
+        n = 4;
+        c = u[0] & 0x07;
+        min = 0x10000;
+    } else {
+        *cp = EDI_UTF8_INVALID;
+        return 1;
+    }
+
+    if (n > len) {
+        *cp = EDI_UTF8_INVALID;
+        return 1;
+    }
+    for (int i = 1; i < n; i++) {
+        if ((u[i] & 0xC0) != 0x80) {
+            *cp = EDI_UTF8_INVALID;
+            return 1;
+        }
+        c = (c << 6) | (u[i] & 0x3F);
+    }
+
+    // Reject overlong forms, surrogates and codepoints past Unicode
+    if (c < min || c > 0x10FFFF || (c >= 0xD800 && c <= 0xDFFF)) {
+        *cp = EDI_UTF8_INVALID;
+        return 1;
+    }
+    *cp = c;
+    return n;
+}
+
+int editorUtf8InRanges(const unsigned int ranges[][2], int n, unsigned int cp) {
+    int lo = 0;
+    int hi = n - 1;
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (cp < ranges[mid][0]) {
+            hi = mid - 1;
+        } else if (cp > ranges[mid][1]) {
+            lo = mid + 1;
+        } else {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Number of columns a codepoint takes. Controls and invalid bytes take one,
+// as they are drawn as an inverted '?'.
+int editorCharWidth(unsigned int cp) {
+    if (cp < 0x300) {
+        return 1;
+    }
+    if (cp < 0x10000 && UTF8_width_cache[cp]) {
+        return UTF8_width_cache[cp] - 1;
+    }
+
+    int width = 1;
+    if (editorUtf8InRanges(UTF8_zero_width, sizeof(UTF8_zero_width) / sizeof(UTF8_zero_width[0]), cp)) {
+        width = 0;
+    } else if (editorUtf8InRanges(UTF8_wide, sizeof(UTF8_wide) / sizeof(UTF8_wide[0]), cp)) {
+        width = 2;
+    }
+
+    if (cp < 0x10000) {
+        UTF8_width_cache[cp] = width + 1;
+    }
+    return width;
+}
+
+// Whether s holds only ASCII bytes, checking 64 bytes at a time for the
+// high bit where SSE2 is available
+int editorIsAscii(const char* s, int len) {
+    int i = 0;
+#ifdef __SSE2__
+    for (; i + 64 <= len; i += 64) {
+        __m128i v = _mm_or_si128(
+                _mm_or_si128(_mm_loadu_si128((const __m128i*) &s[i]),
+                             _mm_loadu_si128((const __m128i*) &s[i + 16])),
+                _mm_or_si128(_mm_loadu_si128((const __m128i*) &s[i + 32]),
+                             _mm_loadu_si128((const __m128i*) &s[i + 48])));
+        if (_mm_movemask_epi8(v)) {
+            return 0;
+        }
+    }
+#endif
+    for (; i < len; i++) {
+        if ((unsigned char) s[i] >= 0x80) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// ******** LINE INDEX ********
+
+// Column at which the wrapped line after the one starting at column
+// 'start' begins, or -1 if that is the row's last line. Lines break at
+// char boundaries: a char that would cross the right edge starts the next
+// line, and so does the cursor at EOL when the last line is full. 'pos'
+// is at the first char of the line, and is moved to that of the next.
+// ASCII rows, and rows narrower than the screen, break every screen width.
+int editorWrapNext(erow* row, struct erowPos* pos, int start) {
+    int cols = E.screen_cols;
+    if (row->ascii || row->rwidth < cols) {
+        return (start + cols <= row->rwidth) ? start + cols : -1;
+    }
+
+    struct erowPos limit = {row->size, start + cols, INT_MAX};
+    editorRowWalk(row, pos, &limit);
+    if (pos->cx == row->size) {
+        return (pos->rx == start + cols) ? pos->rx : -1;
+    }
+    if (pos->rx == start) {
+        // A char wider than the screen takes a line of its own
+        limit.cx = editorRowNextChar(row, pos->cx);
+        limit.rx = INT_MAX;
+        editorRowWalk(row, pos, &limit);
+    }
+    return pos->rx;
+}
+
+// Which wrapped line of a row holds column 'rx', or line 'sub' if that
+// comes first, setting 'start' to the column the line starts at
+int editorWrapSeek(erow* row, int sub, int rx, int* start) {
+    int cols = E.screen_cols;
+    if (row->ascii || row->rwidth < cols) {
+        int line = (rx < row->rwidth ? rx : row->rwidth) / cols;
+        line = line < sub ? line : sub;
+        *start = line * cols;
+        return line;
+    }
+
+    struct erowPos pos = {0, 0, 0};
+    int line = 0;
+    *start = 0;
+    while (line < sub) {
+        int next = editorWrapNext(row, &pos, *start);
+        if (next < 0 || next > rx) {
+            break;
+        }
+        *start = next;
+        line++;
+    }
+    return line;
+}
+
+// Number of screen lines a row takes when wrapped. Rows hidden by a fold
+// take none.
+int editorWrapRowLines(erow* row) {
+    if (row->hidden) {
+        return 0;
+    }
+    int start;
+    return 1 + editorWrapSeek(row, INT_MAX, INT_MAX, &start);
+}
+
+// Number of screen lines a row takes when not wrapping
+int editorFoldRowLines(erow* row) {
+    return !row->hidden;
+}
+
+// Sum of the extra lines of rows [0, at), at <= ix->valid
+int editorLinePrefix(struct editorLineIndex* ix, int at) {
+    int sum = 0;
+    for (int i = at; i > 0; i -= i & -i) {
+        sum += ix->tree[i];
+    }
+    return sum;
+}
+
+// Index the first 'n' rows, reusing the part of the tree that is still
+// valid. A full rebuild only happens when the terminal width changed.
+void editorLineIndexExtend(struct editorLineIndex* ix, int n) {
+    if (ix->cols && ix->cols != E.screen_cols) {
+        ix->cols = E.screen_cols;
+        ix->valid = 0;
+    }
+    if (ix->valid >= n) {
+        return;
+    }
+
+    if (n + 1 > ix->cap) {
+        ix->cap = (n + 1 > ix->cap * 2) ? n + 1 : ix->cap * 2;
+        ix->tree = realloc(ix->tree, sizeof(int) * ix->cap);
+    }
+
+    int v = ix->valid;
+    for (int i = v + 1; i <= n; i++) {
+        ix->tree[i] = ix->lines(&E.row[i - 1]) - 1;
+    }
+
+    // Linear build: push every node into its parent. The valid nodes whose
+    // parents lie past the old prefix are exactly those on its prefix path.
+    for (int i = v; i > 0; i -= i & -i) {
+        if (i + (i & -i) <= n) {
+            ix->tree[i + (i & -i)] += ix->tree[i];
+        }
+    }
+    for (int i = v + 1; i <= n; i++) {
+        if (i + (i & -i) <= n) {
+            ix->tree[i + (i & -i)] += ix->tree[i];
+        }
+    }
+
+    ix->valid = n;
+}
+
+// Rows from 'at' on were inserted, deleted or changed too much to update
+// one by one, so the tree past it is stale
+void editorLineIndexInvalidate(struct editorLineIndex* ix, int at) {
+    if (ix->valid > at) {
+        ix->valid = at;
+    }
+}
+
+// A row's line count may have changed, update it in the tree
+void editorLineUpdateRow(struct editorLineIndex* ix, erow* row) {
+    int at = row->idx;
+    if (at >= ix->valid || (ix->cols && ix->cols != E.screen_cols)) {
+        return;
+    }
+
+    int delta = (ix->lines(row) - 1) - (editorLinePrefix(ix, at + 1) - editorLinePrefix(ix, at));
+    for (int i = at + 1; i <= ix->valid && delta; i += i & -i) {
+        ix->tree[i] += delta;
+    }
+}
+
+// Screen line (counted from the top of the file) on which row 'at' starts
+int editorLineOf(struct editorLineIndex* ix, int at) {
+    editorLineIndexExtend(ix, E.num_rows);
+    return at + editorLinePrefix(ix, at);
+}
+
+// Find the row containing screen line 'line' and which of its lines that
+// is, by descending the tree. Lines past the end of the file map to rows
+// >= E.num_rows.
+int editorLineFind(struct editorLineIndex* ix, int line, int* sub) {
+    editorLineIndexExtend(ix, E.num_rows);
+
+    int step = 1;
+    while (step * 2 <= E.num_rows) {
+        step *= 2;
+    }
+
+    int at = 0;
+    int lines = 0;
+    for (; step; step /= 2) {
+        int next = at + step;
+        if (next <= E.num_rows && lines + ix->tree[next] + step <= line) {
+            at = next;
+            lines += ix->tree[next] + step;
+        }
+    }
+
+    *sub = line - lines;
+    if (at >= E.num_rows) {
+        at += *sub;
+        *sub = 0;
+    }
+    return at;
+}
+
+// Screen line of row 'at' in the current mode. Without folds every row is
+// a line of its own when not wrapping, and no index is needed.
+int editorScreenLineOf(int at) {
+    if (E.wrap) {
+        return editorLineOf(&E.wrap_index, at);
+    }
+    return E.hidden_rows ? editorLineOf(&E.fold_index, at) : at;
+}
+
+// Row on screen line 'line' in the current mode, and which of its wrapped
+// lines that is
+int editorScreenFindLine(int line, int* sub) {
+    if (E.wrap) {
+        return editorLineFind(&E.wrap_index, line, sub);
+    }
+    if (!E.hidden_rows) {
+        *sub = 0;
+        return line;
+    }
+    return editorLineFind(&E.fold_index, line, sub);
+}
+
+// The row shown after row 'at', past any fold
+int editorNextRow(int at) {
+    if (at + 1 >= E.num_rows || !E.row[at + 1].hidden) {
+        return at + 1;
+    }
+    int sub;
+    return editorLineFind(&E.fold_index, editorLineOf(&E.fold_index, at) + 1, &sub);
+}
+
+// The row shown before row 'at' > 0, past any fold
+int editorPrevRow(int at) {
+    if (!E.row[at - 1].hidden) {
+        return at - 1;
+    }
+    int sub;
+    return editorLineFind(&E.fold_index, editorLineOf(&E.fold_index, at) - 1, &sub);
+}
+
+// ******** ROW OPERATIONS ********
+
+// Walk 'pos' forward over whole chars for as long as none of its indexes
+// passes the one in 'limit'
+void editorRowWalk(erow* row, struct erowPos* pos, struct erowPos* limit) {
+    if (row->ascii) {
+        // Every char is a byte and the column is the render index
+        int cx = pos->cx;
+        int rx = pos->rx;
+        int max_rx = limit->rx < limit->ri ? limit->rx : limit->ri;
+        while (cx < limit->cx) {
+            int w = (row->chars[cx] == '\t') ? EDI_TAB_STOP - (rx % EDI_TAB_STOP) : 1;
+            if (rx + w > max_rx) {
+                break;
+            }
+            cx++;
+            rx += w;
+        }
+        pos->cx = cx;
+        pos->rx = rx;
+        pos->ri = rx;
+        return;
+    }
+
+    while (pos->cx < limit->cx) {
+        unsigned char c = row->chars[pos->cx];
+        int n = 1;
+        int w = 1;
+        int rn = 1;
+        if (c == '\t') {
+            w = EDI_TAB_STOP - (pos->rx % EDI_TAB_STOP);
+            rn = w;
+        } else if (c >= 0x80) {
+            unsigned int cp;
+            n = editorUtf8Decode(&row->chars[pos->cx], row->size - pos->cx, &cp);
+            w = editorCharWidth(cp);
+            rn = n;
+        }
+
+        if (pos->cx + n > limit->cx || pos->rx + w > limit->rx || pos->ri + rn > limit->ri) {
+            return;
         }
-        curr_rx++;
-        if (curr_rx > rx) {
-            return cx;
+        pos->cx += n;
+        pos->rx += w;
+        pos->ri += rn;
+    }
+}
+
+// Extend the row's checkpoints so they cover chars up to 'cx', walking
+// on from the last checkpoint that is still valid.
+void editorRowUpdateCheckpoints(erow* row, int cx) {
+    int want = cx / EDI_RX_CHECKPOINT;
+    if (row->rx_ckpt_len >= want) {
+        return;
+    }
+
+    row->rx_ckpt = realloc(row->rx_ckpt, sizeof(struct erowPos) * want);
+
+    int k = row->rx_ckpt_len;
+    struct erowPos pos = {0, 0, 0};
+    if (k) {
+        pos = row->rx_ckpt[k - 1];
+    }
+    for (; k < want; k++) {
+        // Stop at the last char boundary at or before the checkpoint
+        struct erowPos limit = {(k + 1) * EDI_RX_CHECKPOINT, INT_MAX, INT_MAX};
+        editorRowWalk(row, &pos, &limit);
+        row->rx_ckpt[k] = pos;
+    }
+    row->rx_ckpt_len = want;
+}
+
+// Drop the checkpoints past chars index 'cx' after the row changed there.
+// A checkpoint just before it goes too, as decoding the char before the
+// checkpoint may have looked at up to 3 bytes past it.
+void editorRowInvalidateCheckpoints(erow* row, int cx) {
+    int keep = cx / EDI_RX_CHECKPOINT;
+    if (keep > row->rx_ckpt_len) {
+        keep = row->rx_ckpt_len;
+    }
+    while (keep > 0 && row->rx_ckpt[keep - 1].cx + 3 > cx) {
+        keep--;
+    }
+    row->rx_ckpt_len = keep;
+}
+
+// Find the position of the char reached by walking from the start of the
+// row for as long as no index passes the given ones. Starts from the last
+// checkpoint before them, so it never walks more than EDI_RX_CHECKPOINT chars.
+struct erowPos editorRowSeek(erow* row, int cx, int rx, int ri) {
+    editorRowUpdateCheckpoints(row, cx);
+    struct erowPos limit = {cx, rx, ri};
+
+    // Checkpoints grow in all three indexes, so binary search for the
+    // number of them within the limit
+    int lo = 0;
+    int hi = row->rx_ckpt_len;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        struct erowPos* p = &row->rx_ckpt[mid];
+        if (p->cx <= cx && p->rx <= rx && p->ri <= ri) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
     }
-    return cx;
+
+    struct erowPos pos = {0, 0, 0};
+    if (lo) {
+        pos = row->rx_ckpt[lo - 1];
+    }
+    editorRowWalk(row, &pos, &limit);
+    return pos;
+}
+
+int editorRowCxToRx(erow* row, int cx) {
+    return editorRowSeek(row, cx, INT_MAX, INT_MAX).rx;
+}
+
+int editorRowRxToCx(erow *row, int rx) {
+    return editorRowSeek(row, row->size, rx, INT_MAX).cx;
+}
+
+// Convert an index into render (such as a search match) to one into chars
+int editorRowRenderToCx(erow* row, int ri) {
+    return editorRowSeek(row, row->size, INT_MAX, ri).cx;
+}
+
+// Start of the char that chars index 'cx' falls in
+int editorRowCharStart(erow* row, int cx) {
+    if (cx <= 0 || cx >= row->size) {
+        return cx;
+    }
+
+    int lead = cx;
+    while (lead > 0 && cx - lead < 3 && (row->chars[lead] & 0xC0) == 0x80) {
+        lead--;
+    }
+
+    unsigned int cp;
+    int n = editorUtf8Decode(&row->chars[lead], row->size - lead, &cp);
+    return (lead + n > cx) ? lead : cx;
+}
+
+// Index of the char after the one at 'cx'
+int editorRowNextChar(erow* row, int cx) {
+    unsigned int cp;
+    return cx + editorUtf8Decode(&row->chars[cx], row->size - cx, &cp);
+}
+
+// Whether the char at 'cx' takes no column, like a combining mark
+int editorRowZeroWidthAt(erow* row, int cx) {
+    if (cx >= row->size || (unsigned char) row->chars[cx] < 0x80) {
+        return 0;
+    }
+    unsigned int cp;
+    editorUtf8Decode(&row->chars[cx], row->size - cx, &cp);
+    return editorCharWidth(cp) == 0;
 }
 
 void editorUpdateRow(erow* row) {
@@ -563,23 +3189,91 @@ void editorUpdateRow(erow* row) {
 
     free(row->render);
     row->render = malloc(row->size + (tabs * (EDI_TAB_STOP - 1)) + 1);
+    row->ascii = editorIsAscii(row->chars, row->size);
 
     int idx = 0;
-    for (j = 0; j < row->size; j++) {
-        if (row->chars[j] == '\t') {
-            row->render[idx++] = ' ';
-            while ( idx % EDI_TAB_STOP != 0 ) {
+    if (row->ascii) {
+        for (j = 0; j < row->size; j++) {
+            if (row->chars[j] == '\t') {
                 row->render[idx++] = ' ';
+                while ( idx % EDI_TAB_STOP != 0 ) {
+                    row->render[idx++] = ' ';
+                }
+            } else {
+                row->render[idx++] = row->chars[j];
             }
-        } else {
-            row->render[idx++] = row->chars[j];
         }
+        row->rwidth = idx;
+    } else {
+        // Tabs stop at multiples of the column, not of the render index
+        int col = 0;
+        for (j = 0; j < row->size; ) {
+            unsigned char c = row->chars[j];
+            if (c == '\t') {
+                do {
+                    row->render[idx++] = ' ';
+                    col++;
+                } while (col % EDI_TAB_STOP != 0);
+                j++;
+            } else if (c < 0x80) {
+                row->render[idx++] = c;
+                col++;
+                j++;
+            } else {
+                unsigned int cp;
+                int n = editorUtf8Decode(&row->chars[j], row->size - j, &cp);
+                memcpy(&row->render[idx], &row->chars[j], n);
+                idx += n;
+                col += editorCharWidth(cp);
+                j += n;
+            }
+        }
+        row->rwidth = col;
     }
 
     row->render[idx] = '\0';
     row->rsize = idx;
+    row->rx_ckpt_len = 0;
+    editorLineUpdateRow(&E.wrap_index, row);
+
+    editorUpdateSyntax(row);
+}
+
+// Patch render and hl after the characters at 'at' changed from 'removed'
+// to 'inserted' ones, instead of re-expanding and rehighlighting the whole
+// line. Only valid when no tab follows 'at' either before or after the
+// edit, so everything past 'at' in render is a plain copy of chars.
+void editorUpdateRowFrom(erow* row, int at, int removed, int inserted) {
+    int old_rsize = row->rsize;
+    int rat = old_rsize - (row->size - inserted + removed - at);
+    editorRowInvalidateCheckpoints(row, at);
+    // hl is patched along with render, unless the row is to be highlighted
+    // again anyway
+    if (row->hl_ready) {
+        editorHlDense(row);
+    } else {
+        editorHlFree(row);
+    }
+
+    row->rsize = rat + row->size - at;
+    row->render = realloc(row->render, row->rsize + 1);
+    memcpy(&row->render[rat], &row->chars[at], row->size - at + 1);
+
+    if (row->hl) {
+        if (inserted > removed) {
+            row->hl = realloc(row->hl, row->rsize + 1);
+        }
+        memmove(&row->hl[rat + inserted], &row->hl[rat + removed], old_rsize - rat - removed);
+    }
+
+    // A row stays marked non-ASCII until it is next re-expanded in full
+    if (row->ascii) {
+        row->ascii = editorIsAscii(&row->chars[at], inserted);
+    }
+    row->rwidth = row->ascii ? row->rsize : editorRowCxToRx(row, row->size);
 
-    editorUpdateSyntax(row);
+    editorLineUpdateRow(&E.wrap_index, row);
+    editorUpdateSyntaxFrom(row, rat, rat + inserted);
 }
 
 void editorInsertRow(int at, char* s, size_t len) {
@@ -589,6 +3283,9 @@ void editorInsertRow(int at, char* s, size_t len) {
 
     E.row = realloc(E.row, sizeof(erow) * (E.num_rows + 1));
     memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.num_rows - at));
+    editorLineIndexInvalidate(&E.wrap_index, at);
+    editorLineIndexInvalidate(&E.fold_index, at);
+    editorBracketInvalidate(at);
     for (int j = at + 1; j <= E.num_rows; j++) {
         E.row[j].idx++;
     }
@@ -601,29 +3298,49 @@ void editorInsertRow(int at, char* s, size_t len) {
     E.row[at].chars[len] = '\0';
 
     E.row[at].rsize = 0;
+    E.row[at].rwidth = 0;
+    E.row[at].hidden = 0;
     E.row[at].render = NULL;
 
     E.row[at].hl = NULL;
+    E.row[at].hl_runs = NULL;
+    E.row[at].hl_nruns = 0;
     E.row[at].hl_open_comment = 0;
+    E.row[at].rx_ckpt = NULL;
+    E.row[at].rx_ckpt_len = 0;
+    E.row[at].br_ready = 0;
 
+    E.num_rows++;
     editorUpdateRow(&E.row[at]);
 
-    E.num_rows++;
+    // Appending (as when loading a file) keeps the wrap index current
+    if (E.wrap_index.valid == at && at == E.num_rows - 1) {
+        editorLineIndexExtend(&E.wrap_index, E.num_rows);
+    }
+
     E.dirty++;
 }
 
 void editorFreeRow(erow* row) {
     free(row->render);
     free(row->chars);
-    free(row->hl);
+    editorHlFree(row);
+    free(row->rx_ckpt);
 }
 
 void editorDelRow(int at) {
     if (at < 0 || at >= E.num_rows) {
         return;
     }
+    if (E.row[at].hidden) {
+        E.hidden_rows--;
+    }
     editorFreeRow(&E.row[at]);
     memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.num_rows - at - 1));
+    editorLineIndexInvalidate(&E.wrap_index, at);
+    editorLineIndexInvalidate(&E.fold_index, at);
+    editorBracketInvalidate(at);
+    editorSyntaxInvalidate(at);
     for (int j = at; j < E.num_rows - 1; j++) {
         E.row[j].idx--;
     }
@@ -647,16 +3364,25 @@ void editorRowInsertChar(erow* row, int at, int c) {
 
     row->size++;
     row->chars[at] = c;
-    editorUpdateRow(row);
+    if (memchr(&row->chars[at], '\t', row->size - at)) {
+        editorUpdateRow(row);
+    } else {
+        editorUpdateRowFrom(row, at, 0, 1);
+    }
     E.dirty++;
 }
 
 void editorRowAppendString(erow* row, char* s, size_t len) {
+    int at = row->size;
     row->chars = realloc(row->chars, row->size + len + 1);
     memcpy(&row->chars[row->size], s, len);
     row->size += len;
     row->chars[row->size] = '\0';
-    editorUpdateRow(row);
+    if (memchr(s, '\t', len)) {
+        editorUpdateRow(row);
+    } else {
+        editorUpdateRowFrom(row, at, 0, len);
+    }
     E.dirty++;
 }
 
@@ -664,9 +3390,15 @@ void editorRowDelChar(erow* row, int at) {
     if (at < 0 || at >= row->size) {
         return;
     }
+    // A deleted tab or a tab after it changes the width of the rest of the line
+    int tabs = memchr(&row->chars[at], '\t', row->size - at) != NULL;
     memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
     row->size--;
-    editorUpdateRow(row);
+    if (tabs) {
+        editorUpdateRow(row);
+    } else {
+        editorUpdateRowFrom(row, at, 1, 0);
+    }
     E.dirty++;
 }
 
@@ -692,10 +3424,16 @@ void editorInsertNewline() {
         // Reassign the row pointer in case the realloc() in editorInsertRow() invalidates the pointer
         row = &E.row[E.cy];
 
-        // Truncate the current row and call editorUpdateRow() on it
+        // Truncate the current row and update its render and highlighting
+        int removed = row->size - E.cx;
+        int tabs = memchr(&row->chars[E.cx], '\t', removed) != NULL;
         row->size = E.cx;
         row->chars[row->size] = '\0';
-        editorUpdateRow(row);
+        if (tabs) {
+            editorUpdateRow(row);
+        } else {
+            editorUpdateRowFrom(row, E.cx, removed, 0);
+        }
     }
     E.cy++;
     E.cx = 0;
@@ -714,8 +3452,12 @@ void editorDelChar() {
 
     erow* row = &E.row[E.cy];
     if (E.cx > 0) {
-        editorRowDelChar(row, E.cx - 1);
-        E.cx--;
+        // Delete the whole codepoint before the cursor
+        int start = editorRowCharStart(row, E.cx - 1);
+        while (E.cx > start) {
+            editorRowDelChar(row, start);
+            E.cx--;
+        }
     } else {
         // This is the special case where the beginning of a line is deleted
         E.cx = E.row[E.cy - 1].size;
@@ -753,8 +3495,6 @@ void editorOpen(char* filename) {
     free(E.filename);
     E.filename = strdup(filename);
 
-    editorSelectSyntaxHighlight();
-
     FILE* fp = fopen(filename, "r");
     if (!fp) {
         die("fopen");
@@ -775,6 +3515,11 @@ void editorOpen(char* filename) {
     free(line);
     fclose(fp);
 
+    // With the first and last rows there to sniff. The rows just read are
+    // not highlighted yet, so unlike editorSelectSyntaxHighlight() this
+    // doesn't need to visit them.
+    editorDetectSyntax();
+
     // editorAppendRow() above increments the dirty bit so clear it
     E.dirty = 0;
 }
@@ -820,18 +3565,247 @@ void editorSave() {
 
 // ******** FIND ********
 
+// First match of the search in p[i, len), or -1. Any byte equal to the
+// needle's first is checked in full.
+int editorSearchScalar(const struct editorSearch* s, const char* p, int i, int len) {
+    int n = s->len;
+    while (i + n <= len) {
+        const char* c = memchr(&p[i], s->needle[0], len - n + 1 - i);
+        if (c == NULL) {
+            return -1;
+        }
+        i = c - p;
+        if (!memcmp(&p[i + 1], &s->needle[1], n - 1)) {
+            return i;
+        }
+        i++;
+    }
+    return -1;
+}
+
+#ifdef __SSE2__
+// The same, 16 positions at a time. Only positions where both the first
+// and the last byte of the needle are in place are compared in full. The
+// last block ends where the last match could start, overlapping positions
+// already checked, so that short rows need no scalar tail.
+int editorSearchSse2(const struct editorSearch* s, const char* p, int i, int len) {
+    int n = s->len;
+    int end = len - n + 1;
+    if (end < 16) {
+        return editorSearchScalar(s, p, i, len);
+    }
+    __m128i first = _mm_set1_epi8(s->needle[0]);
+    __m128i last = _mm_set1_epi8(s->needle[n - 1]);
+    while (i < end) {
+        int j = (i + 16 <= end) ? i : end - 16;
+        __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) &p[j]), first);
+        __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) &p[j + n - 1]), last);
+        unsigned int hits = _mm_movemask_epi8(_mm_and_si128(a, b)) & (0xFFFFu << (i - j));
+        while (hits) {
+            int at = j + __builtin_ctz(hits);
+            if (!memcmp(&p[at + 1], &s->needle[1], n - 2)) {
+                return at;
+            }
+            hits &= hits - 1;
+        }
+        i = j + 16;
+    }
+    return -1;
+}
+#endif
+
+#ifdef EDI_AVX2
+// And 32 positions at a time
+__attribute__((target("avx2")))
+int editorSearchAvx2(const struct editorSearch* s, const char* p, int i, int len) {
+    int n = s->len;
+    int end = len - n + 1;
+    if (end < 32) {
+        return editorSearchSse2(s, p, i, len);
+    }
+    __m256i first = _mm256_set1_epi8(s->needle[0]);
+    __m256i last = _mm256_set1_epi8(s->needle[n - 1]);
+    while (i < end) {
+        int j = (i + 32 <= end) ? i : end - 32;
+        __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) &p[j]), first);
+        __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*) &p[j + n - 1]), last);
+        unsigned int hits = (unsigned int) _mm256_movemask_epi8(_mm256_and_si256(a, b)) & (0xFFFFFFFFu << (i - j));
+        while (hits) {
+            int at = j + __builtin_ctz(hits);
+            if (!memcmp(&p[at + 1], &s->needle[1], n - 2)) {
+                return at;
+            }
+            hits &= hits - 1;
+        }
+        i = j + 32;
+    }
+    return -1;
+}
+#endif
+
+// Horspool: compare at the byte under the needle's end, then shift by how
+// far back that byte last occurs in the rest of the needle
+int editorSearchHorspool(const struct editorSearch* s, const char* p, int i, int len) {
+    int n = s->len;
+    unsigned char last = s->needle[n - 1];
+    while (i + n <= len) {
+        unsigned char c = p[i + n - 1];
+        if (c == last && !memcmp(&p[i], s->needle, n - 1)) {
+            return i;
+        }
+        i += s->shift[c];
+    }
+    return -1;
+}
+
+// Matches needles of 2 to EDI_SEARCH_LONG - 1 bytes, as fast as the CPU
+// allows. Set with the first search prepared.
+int (*editorSearchShort)(const struct editorSearch* s, const char* p, int i, int len) = NULL;
+
+// The widest editorSearch*() filter this CPU runs
+int (*editorSearchKernel())(const struct editorSearch*, const char*, int, int) {
+#ifdef EDI_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        return editorSearchAvx2;
+    }
+#endif
+#ifdef __SSE2__
+    return editorSearchSse2;
+#else
+    return editorSearchScalar;
+#endif
+}
+
+// Get a search for 'needle' ready to run over any number of rows
+void editorSearchPrepare(struct editorSearch* s, const char* needle) {
+    if (editorSearchShort == NULL) {
+        editorSearchShort = editorSearchKernel();
+    }
+    s->needle = strdup(needle);
+    s->len = strlen(needle);
+    for (int c = 0; c < 256; c++) {
+        s->shift[c] = s->len;
+    }
+    for (int k = 0; k < s->len - 1; k++) {
+        s->shift[(unsigned char) needle[k]] = s->len - 1 - k;
+    }
+}
+
+void editorSearchFree(struct editorSearch* s) {
+    free(s->needle);
+    s->needle = NULL;
+}
+
+// Where the first match of a prepared search in p[i, len) starts, or -1
+int editorSearchIn(const struct editorSearch* s, const char* p, int i, int len) {
+    if (s->len == 0) {
+        return (i <= len) ? i : -1;
+    }
+    if (s->len == 1) {
+        const char* c = (i < len) ? memchr(&p[i], s->needle[0], len - i) : NULL;
+        return c ? c - p : -1;
+    }
+    if (s->len >= EDI_SEARCH_LONG) {
+        return editorSearchHorspool(s, p, i, len);
+    }
+    return editorSearchShort(s, p, i, len);
+}
+
+void editorOverlayAdd(int row, int start, int end, unsigned char hl) {
+    if (E.overlay_len == E.overlay_cap) {
+        E.overlay_cap = E.overlay_cap ? E.overlay_cap * 2 : 64;
+        E.overlay = realloc(E.overlay, sizeof(struct editorOverlay) * E.overlay_cap);
+    }
+    struct editorOverlay* o = &E.overlay[E.overlay_len++];
+    o->row = row;
+    o->start = start;
+    o->end = end;
+    o->hl = hl;
+}
+
+// Overlay the rows on screen from 'top' with every match of the search
+// being typed. Only the chars of each row that are drawn are searched, so
+// long rows cost a screenful, and only the matches found are mapped to
+// render.
+void editorOverlayBuild(int top, int sub) {
+    E.overlay_len = 0;
+    if (E.find.needle == NULL || E.find.len == 0) {
+        return;
+    }
+    int len = E.find.len;
+    int lines = E.screen_rows;
+    for (int r = top; r < E.num_rows && lines > 0; r = editorNextRow(r)) {
+        erow* row = &E.row[r];
+        int from = E.col_offset;
+        int cols = E.screen_cols;
+        if (E.wrap) {
+            // Lines broken early show fewer columns, so this is enough
+            from = 0;
+            if (r == top) {
+                editorWrapSeek(row, sub, INT_MAX, &from);
+            }
+            cols = lines * E.screen_cols;
+            lines -= editorWrapRowLines(row) - (r == top ? sub : 0);
+        } else {
+            lines--;
+        }
+        // Widen the window so that matches crossing its edges are found
+        int lo = editorRowSeek(row, row->size, from, INT_MAX).cx - (len - 1);
+        int hi = editorRowSeek(row, row->size, from + cols, INT_MAX).cx + (len - 1);
+        lo = lo < 0 ? 0 : lo;
+        hi = hi > row->size ? row->size : hi;
+        // Matches come in order, so each is mapped walking on from the last
+        struct erowPos pos = editorRowSeek(row, lo, INT_MAX, INT_MAX);
+        for (int at = editorSearchIn(&E.find, row->chars, lo, hi); at >= 0;
+                at = editorSearchIn(&E.find, row->chars, at + len, hi)) {
+            struct erowPos limit = {at, INT_MAX, INT_MAX};
+            editorRowWalk(row, &pos, &limit);
+            int start = pos.ri;
+            limit.cx = at + len;
+            editorRowWalk(row, &pos, &limit);
+            editorOverlayAdd(r, start, pos.ri, HL_MATCH);
+        }
+    }
+}
+
+// Index of the first overlay range on 'row' ending after render index ri,
+// or of the range after them all
+int editorOverlayFind(int row, int ri) {
+    int lo = 0;
+    int hi = E.overlay_len;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        struct editorOverlay* o = &E.overlay[mid];
+        if (o->row < row || (o->row == row && o->end <= ri)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Add a range where it belongs in the overlay, unless it overlaps one
+// already there
+void editorOverlayInsert(int row, int start, int end, unsigned char hl) {
+    int k = editorOverlayFind(row, start);
+    if (k < E.overlay_len && E.overlay[k].row == row && E.overlay[k].start < end) {
+        return;
+    }
+    editorOverlayAdd(row, start, end, hl);
+    memmove(&E.overlay[k + 1], &E.overlay[k], sizeof(struct editorOverlay) * (E.overlay_len - 1 - k));
+    E.overlay[k].row = row;
+    E.overlay[k].start = start;
+    E.overlay[k].end = end;
+    E.overlay[k].hl = hl;
+}
+
 void editorFindCallback(char* query, int key) {
     static int last_match = -1; // -1 means there was no last match
     static int direction = 1;   // 1 for forward; -1 for backward
 
-    static int saved_hl_line;
-    static char* saved_hl = NULL;
-
-    if (saved_hl) {
-        memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-        free(saved_hl);
-        saved_hl = NULL;
-    }
+    // Matches are shown, all of those on screen, until the search ends
+    editorSearchFree(&E.find);
 
     if (key == '\r' || key == '\x1b') {
         // When we leave search, reset the variables for the next search
@@ -854,6 +3828,7 @@ void editorFindCallback(char* query, int key) {
     if (last_match == -1) {
         direction = 1;
     }
+    editorSearchPrepare(&E.find, query);
 
     // Current is the index of the current row that is being searched
     int current = last_match;
@@ -874,51 +3849,614 @@ void editorFindCallback(char* query, int key) {
         }
 
         erow* row = &E.row[current];
-        char* match = strstr(row->render, query);
-        if (match) {
+        // Searched as typed, so tabs only match tabs. Where the match is on
+        // screen is worked out when it is drawn.
+        int match = editorSearchIn(&E.find, row->chars, 0, row->size);
+        if (match >= 0) {
             last_match = current;
             E.cy = current;
 
-            // Convert the match pointer to an index
-            E.cx = editorRowRxToCx(row, match - row->render);
+            E.cx = editorRowCharStart(row, match);
+
+            // Set row offset so match line is at the top of the screen
+            E.row_offset = E.num_rows;
+            E.line_offset = INT_MAX;
+            break;
+        }
+    }
+}
+
+void editorFind() {
+    int saved_cx = E.cx;
+    int saved_cy = E.cy;
+    int saved_col_offset = E.col_offset;
+    int saved_row_offset = E.row_offset;
+    int saved_line_offset = E.line_offset;
+
+    char* query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
+
+    if (query) {
+        free(query);
+    } else {
+        E.cx = saved_cx;
+        E.cy = saved_cy;
+        E.col_offset = saved_col_offset;
+        E.row_offset = saved_row_offset;
+        E.line_offset = saved_line_offset;
+    }
+}
+
+// ******** BRACKETS ********
+
+// Matching brackets are found through a segment tree summing the bracket
+// balance of blocks of rows, which skips whole blocks, and then whole
+// halves of the file, that can't hold the match. Rows are summed from
+// their highlighting, so brackets in strings and comments don't count.
+
+// The kind of bracket c is (0 for (), 1 for [] and 2 for {}) times two,
+// plus one if it closes; -1 if c is no bracket
+int editorBracketCode(int c) {
+    switch (c) {
+        case '(':
+            return 0;
+        case ')':
+            return 1;
+        case '[':
+            return 2;
+        case ']':
+            return 3;
+        case '{':
+            return 4;
+        case '}':
+            return 5;
+        default:
+            return -1;
+    }
+}
+
+// Code of the bracket at render index i of a highlighted row, or -1 if
+// there is none there or it is in a string or comment
+int editorBracketAt(erow* row, int i) {
+    if (i < 0 || i >= row->rsize) {
+        return -1;
+    }
+    int b = editorBracketCode((unsigned char) row->render[i]);
+    if (b < 0) {
+        return -1;
+    }
+    unsigned char hl = editorHlAt(row, i);
+    return (hl == HL_STRING || hl == HL_COMMENT || hl == HL_MLCOMMENT) ? -1 : b;
+}
+
+// Append the balance 'next' to 'sum', for each kind of bracket
+void editorBracketAdd(struct editorBracketSum* sum, const struct editorBracketSum* next) {
+    for (int k = 0; k < EDI_BRACKETS; k++) {
+        if (sum[k].net + next[k].min < sum[k].min) {
+            sum[k].min = sum[k].net + next[k].min;
+        }
+        sum[k].net += next[k].net;
+    }
+}
+
+// Whether text with balance 's' holds the bracket matching one 'depth'
+// deep, searching forwards (dir 1) or backwards (dir -1)
+int editorBracketHolds(const struct editorBracketSum* s, int dir, int depth) {
+    return (dir > 0) ? depth + s->min <= 0 : s->net - s->min >= depth;
+}
+
+// Searches for the bracket pair drawn with a frame give up at the frame's
+// highlighting deadline
+int editorBracketLate() {
+    return E.hl_deadline && editorNow() > E.hl_deadline;
+}
+
+// Make sure a row has its bracket summary, highlighting it if it needs to
+// be. Returns 0 if the deadline passed first, or if the row is outside the
+// ones the search may sum.
+int editorBracketSumRow(erow* row) {
+    if (row->br_ready) {
+        return 1;
+    }
+    if (editorBracketLate() || (E.br_bottom && (row->idx < E.br_top || row->idx >= E.br_bottom))) {
+        return 0;
+    }
+    editorSyntaxEnsure(row);
+    memset(row->br_sum, 0, sizeof(row->br_sum));
+    for (int i = 0; i < row->rsize; i++) {
+        int b = editorBracketAt(row, i);
+        if (b >= 0) {
+            struct editorBracketSum* s = &row->br_sum[b / 2];
+            s->net += (b & 1) ? -1 : 1;
+            if (s->net < s->min) {
+                s->min = s->net;
+            }
+        }
+    }
+    row->br_ready = 1;
+    return 1;
+}
+
+// Sum the rows of block b into its leaf, leaving out and counting as
+// dirty those without a summary
+void editorBracketSumBlock(int b) {
+    struct editorBracketNode* leaf = &E.br_tree[E.br_leaves + b];
+    memset(leaf, 0, sizeof(struct editorBracketNode));
+    int end = (b + 1) * EDI_BRACKET_BLOCK;
+    for (int r = b * EDI_BRACKET_BLOCK; r < end && r < E.num_rows; r++) {
+        if (E.row[r].br_ready) {
+            editorBracketAdd(leaf->sum, E.row[r].br_sum);
+        } else {
+            leaf->dirty++;
+        }
+    }
+}
+
+void editorBracketPull(int i) {
+    E.br_tree[i] = E.br_tree[2 * i];
+    editorBracketAdd(E.br_tree[i].sum, E.br_tree[2 * i + 1].sum);
+    E.br_tree[i].dirty += E.br_tree[2 * i + 1].dirty;
+}
+
+// Bring the tree up to date with the rows. Only blocks from the first one
+// that rows were inserted into or deleted from are summed again, unless
+// the file outgrew the leaves.
+void editorBracketIndexExtend() {
+    int blocks = (E.num_rows + EDI_BRACKET_BLOCK - 1) / EDI_BRACKET_BLOCK;
+    if (blocks > E.br_leaves) {
+        int leaves = E.br_leaves ? E.br_leaves : 1;
+        while (leaves < blocks) {
+            leaves *= 2;
+        }
+        E.br_tree = realloc(E.br_tree, sizeof(struct editorBracketNode) * 2 * leaves);
+        E.br_leaves = leaves;
+        E.br_valid = 0;
+    }
+    if (E.br_valid >= E.br_leaves) {
+        return;
+    }
+
+    for (int b = E.br_valid; b < E.br_leaves; b++) {
+        editorBracketSumBlock(b);
+    }
+    for (int lo = (E.br_leaves + E.br_valid) / 2, hi = E.br_leaves - 1; hi >= 1; lo /= 2, hi /= 2) {
+        for (int i = lo; i <= hi; i++) {
+            editorBracketPull(i);
+        }
+    }
+    E.br_valid = E.br_leaves;
+}
+
+// Rows were inserted or deleted at 'at', so the blocks from its on are stale
+void editorBracketInvalidate(int at) {
+    if (E.br_valid > at / EDI_BRACKET_BLOCK) {
+        E.br_valid = at / EDI_BRACKET_BLOCK;
+    }
+}
+
+// A row's hl changed, so its summary has to be worked out again
+void editorBracketTouch(erow* row) {
+    if (!row->br_ready) {
+        return;
+    }
+    row->br_ready = 0;
+    int b = row->idx / EDI_BRACKET_BLOCK;
+    if (b >= E.br_valid) {
+        return;
+    }
+    for (int i = E.br_leaves + b; i >= 1; i /= 2) {
+        E.br_tree[i].dirty++;
+    }
+}
+
+// Sum the rows of block b that have no summary, then the block. Returns 0
+// if the deadline passed first.
+int editorBracketResolve(int b) {
+    int end = (b + 1) * EDI_BRACKET_BLOCK;
+    for (int r = b * EDI_BRACKET_BLOCK; r < end && r < E.num_rows; r++) {
+        if (!editorBracketSumRow(&E.row[r])) {
+            return 0;
+        }
+    }
+    editorBracketSumBlock(b);
+    for (int i = (E.br_leaves + b) / 2; i >= 1; i /= 2) {
+        editorBracketPull(i);
+    }
+    return 1;
+}
+
+// Search the blocks under node i, which covers blocks [lo, hi), for the
+// one holding the bracket of kind k matching one 'depth' deep: the first
+// from block 'from' on going forwards, or the last up to it going
+// backwards. Blocks passed over take their brackets off depth. Returns the
+// block, -1 if there is none, or -2 if it gave up.
+int editorBracketDescend(int i, int lo, int hi, int from, int k, int dir, int* depth) {
+    if ((dir > 0) ? hi <= from : lo > from) {
+        return -1;
+    }
+    struct editorBracketNode* node = &E.br_tree[i];
+    if (hi - lo == 1) {
+        // Highlighting rows can move the frontier past rows already summed
+        while (node->dirty) {
+            if (!editorBracketResolve(lo)) {
+                return -2;
+            }
+        }
+        if (!editorBracketHolds(&node->sum[k], dir, *depth)) {
+            *depth += dir * node->sum[k].net;
+            return -1;
+        }
+        return lo;
+    }
+
+    int whole = (dir > 0) ? lo >= from : hi - 1 <= from;
+    if (whole && node->dirty == 0 && !editorBracketHolds(&node->sum[k], dir, *depth)) {
+        *depth += dir * node->sum[k].net;
+        return -1;
+    }
+
+    int mid = (lo + hi) / 2;
+    int found;
+    if (dir > 0) {
+        found = editorBracketDescend(2 * i, lo, mid, from, k, dir, depth);
+        if (found == -1) {
+            found = editorBracketDescend(2 * i + 1, mid, hi, from, k, dir, depth);
+        }
+    } else {
+        found = editorBracketDescend(2 * i + 1, mid, hi, from, k, dir, depth);
+        if (found == -1) {
+            found = editorBracketDescend(2 * i, lo, mid, from, k, dir, depth);
+        }
+    }
+    return found;
+}
+
+// Search a highlighted row from render index i, forwards or backwards,
+// for the bracket of kind k matching one 'depth' deep. Returns its render
+// index, or -1 with depth updated for the rest of the row, or -2 if the
+// deadline passed.
+int editorBracketScanRow(erow* row, int i, int k, int dir, int* depth) {
+    for (; i >= 0 && i < row->rsize; i += dir) {
+        if ((i & 0xFFFF) == 0 && editorBracketLate()) {
+            return -2;
+        }
+        int b = editorBracketAt(row, i);
+        if (b >= 0 && b / 2 == k) {
+            *depth += (b & 1) ? -dir : dir;
+            if (*depth == 0) {
+                return i;
+            }
+        }
+    }
+    return -1;
+}
+
+// Find the bracket of kind k matching one 'depth' deep, searching from
+// render index i of row 'at' forwards (dir 1) or backwards (dir -1). Sets
+// *ri to its render index and returns its row; -1 if there is none, -2 if
+// it gave up.
+int editorBracketFind(int at, int i, int k, int dir, int depth, int* ri) {
+    editorSyntaxEnsure(&E.row[at]);
+    *ri = editorBracketScanRow(&E.row[at], i, k, dir, &depth);
+    if (*ri != -1) {
+        return (*ri < 0) ? -2 : at;
+    }
+
+    // The rest of the block row by row, then on through the tree to the
+    // block holding the match, and through that row by row. The rows a
+    // search may sum are gone through row by row too, to the end of the
+    // block they end in, as the tree would sum whole blocks.
+    editorBracketIndexExtend();
+    int block = at / EDI_BRACKET_BLOCK;
+    int r = at + dir;
+    while (r >= 0 && r < E.num_rows) {
+        for (; r >= 0 && r < E.num_rows && (r / EDI_BRACKET_BLOCK == block ||
+                    (r >= E.br_top && r < E.br_bottom)); r += dir) {
+            block = r / EDI_BRACKET_BLOCK;
+            erow* row = &E.row[r];
+            if (!editorBracketSumRow(row)) {
+                return -2;
+            }
+            if (editorBracketHolds(&row->br_sum[k], dir, depth)) {
+                *ri = editorBracketScanRow(row, (dir > 0) ? 0 : row->rsize - 1, k, dir, &depth);
+                return (*ri < 0) ? -2 : r;
+            }
+            depth += dir * row->br_sum[k].net;
+        }
+        if (r < 0 || r >= E.num_rows) {
+            break;
+        }
+
+        block = editorBracketDescend(1, 0, E.br_leaves, block + dir, k, dir, &depth);
+        if (block < 0) {
+            return block;
+        }
+        r = block * EDI_BRACKET_BLOCK;
+        if (dir < 0) {
+            r += EDI_BRACKET_BLOCK - 1;
+            r = (r < E.num_rows) ? r : E.num_rows - 1;
+        }
+    }
+    return -1;
+}
+
+// The pair of brackets at render index i of row 'at': the bracket there
+// and its match if there is one there, else the innermost pair around it.
+// Returns 1 if there is one, 0 if there is none, or -2 if it gave up.
+int editorBracketPair(int at, int i, int* row1, int* ri1, int* row2, int* ri2) {
+    editorSyntaxEnsure(&E.row[at]);
+    int b = editorBracketAt(&E.row[at], i);
+    if (b >= 0) {
+        int dir = (b & 1) ? -1 : 1;
+        *row1 = at;
+        *ri1 = i;
+        *row2 = editorBracketFind(at, i + dir, b / 2, dir, 1, ri2);
+        return (*row2 >= 0) ? 1 : (*row2 == -2) ? -2 : 0;
+    }
+
+    // The innermost pair opens at the nearest unmatched opening bracket.
+    // A search that gave up at a row it may not sum had passed every row
+    // from there to br_top, so it can only have missed ones further out.
+    int kind = -1;
+    int gave_up = 0;
+    for (int k = 0; k < EDI_BRACKETS; k++) {
+        int ri;
+        int r = editorBracketFind(at, i - 1, k, -1, 1, &ri);
+        if (r == -2 && editorBracketLate()) {
+            return -2;
+        }
+        gave_up |= r == -2;
+        if (r >= 0 && (kind < 0 || r > *row1 || (r == *row1 && ri > *ri1))) {
+            kind = k;
+            *row1 = r;
+            *ri1 = ri;
+        }
+    }
+    if (gave_up && (kind < 0 || *row1 < E.br_top)) {
+        return -2;
+    }
+    if (kind < 0) {
+        return 0;
+    }
+    *row2 = editorBracketFind(*row1, *ri1 + 1, kind, 1, 1, ri2);
+    return (*row2 >= 0) ? 1 : (*row2 == -2) ? -2 : 0;
+}
+
+// Move the cursor to the bracket matching the one it is on, or else to
+// the opening bracket of the innermost pair around it
+void editorBracketJump() {
+    if (E.cy >= E.num_rows) {
+        return;
+    }
+    // Rows past the frontier may have been summed for a state they no
+    // longer start in
+    editorSyntaxAdvance(E.num_rows);
+
+    int i = editorRowSeek(&E.row[E.cy], E.cx, INT_MAX, INT_MAX).ri;
+    int row1, ri1, row2, ri2;
+    if (editorBracketPair(E.cy, i, &row1, &ri1, &row2, &ri2) != 1) {
+        editorSetStatusMessage("No matching bracket");
+        return;
+    }
+    if (row1 == E.cy && ri1 == i) {
+        E.cy = row2;
+        E.cx = editorRowRenderToCx(&E.row[row2], ri2);
+    } else {
+        E.cy = row1;
+        E.cx = editorRowRenderToCx(&E.row[row1], ri1);
+    }
+}
+
+// Overlay the pair of brackets at or around the cursor. Only rows already
+// summed, and rows [top, bottom) which the frame highlights anyway, are
+// looked at, so that a frame never highlights rows off screen for it. A
+// pair needing others is left to editorBracketIdle.
+void editorBracketOverlay(int top, int bottom) {
+    E.br_pending = 0;
+    if (E.cy >= E.num_rows) {
+        return;
+    }
+    int i = editorRowSeek(&E.row[E.cy], E.cx, INT_MAX, INT_MAX).ri;
+    int row1, ri1, row2, ri2;
+    E.br_top = top;
+    E.br_bottom = bottom;
+    int found = editorBracketPair(E.cy, i, &row1, &ri1, &row2, &ri2);
+    E.br_bottom = 0;
+    if (found == 1) {
+        editorOverlayInsert(row1, ri1, ri1 + 1, HL_BRACKET);
+        editorOverlayInsert(row2, ri2, ri2 + 1, HL_BRACKET);
+    }
+    E.br_pending = found == -2;
+}
+
+// Called while waiting for input: search for the pair the last frame gave
+// up on through any rows, in EDI_HL_BUDGET slices. Rows summed stay so,
+// and the frame drawn once it is found picks the pair up from them.
+void editorBracketIdle() {
+    struct pollfd in = {STDIN_FILENO, POLLIN, 0};
+    while (E.br_pending && E.cy < E.num_rows && poll(&in, 1, 0) == 0) {
+        int i = editorRowSeek(&E.row[E.cy], E.cx, INT_MAX, INT_MAX).ri;
+        int row1, ri1, row2, ri2;
+        E.hl_deadline = editorNow() + EDI_HL_BUDGET;
+        int found = editorBracketPair(E.cy, i, &row1, &ri1, &row2, &ri2);
+        E.hl_deadline = 0;
+        if (found != -2) {
+            E.br_pending = 0;
+            if (found == 1) {
+                editorRefreshScreen();
+            }
+            return;
+        }
+    }
+}
+
+// ******** FOLDING ********
+
+// A fold hides the rows of the block a row starts, and is opened again as
+// a whole. Hidden rows take no lines in the line indexes, so drawing,
+// scrolling and moving the cursor past a fold are lookups like any other.
+
+// Indentation of a row in columns, or -1 if it is blank
+int editorFoldIndent(erow* row) {
+    int i = 0;
+    while (i < row->rsize && row->render[i] == ' ') {
+        i++;
+    }
+    return (i < row->rsize) ? i : -1;
+}
+
+// End of the block of rows after 'at' indented deeper than it, leaving
+// out blank rows at its end
+int editorFoldIndentEnd(int at) {
+    int indent = editorFoldIndent(&E.row[at]);
+    int end = at + 1;
+    if (indent < 0) {
+        return end;
+    }
+    for (int r = at + 1; r < E.num_rows; r++) {
+        int i = editorFoldIndent(&E.row[r]);
+        if (i >= 0 && i <= indent) {
+            break;
+        }
+        if (i > indent) {
+            end = r + 1;
+        }
+    }
+    return end;
+}
+
+// End of the block row 'at' starts, which a fold there hides up to (not
+// including). A block opened by a bracket left open on the row (the first
+// one, if several are) ends at the row closing it; otherwise it is the
+// rows indented deeper than this one.
+int editorFoldEnd(int at) {
+    erow* row = &E.row[at];
+    editorSyntaxEnsure(row);
+
+    // Only the bottom of each kind's stack of open brackets matters: it is
+    // the first bracket of that kind still open at the end of the row
+    int depth[EDI_BRACKETS] = {0};
+    int first[EDI_BRACKETS];
+    for (int i = 0; i < row->rsize; i++) {
+        int b = editorBracketAt(row, i);
+        if (b < 0) {
+            continue;
+        }
+        int k = b / 2;
+        if (b & 1) {
+            depth[k] -= depth[k] > 0;
+        } else if (depth[k]++ == 0) {
+            first[k] = i;
+        }
+    }
+
+    int kind = -1;
+    for (int k = 0; k < EDI_BRACKETS; k++) {
+        if (depth[k] && (kind < 0 || first[k] < first[kind])) {
+            kind = k;
+        }
+    }
+    if (kind >= 0) {
+        int ri;
+        int end = editorBracketFind(at, first[kind] + 1, kind, 1, 1, &ri);
+        if (end > at) {
+            return end;
+        }
+    }
+    return editorFoldIndentEnd(at);
+}
 
-            // Set row offset so match line is at the top of the screen
-            E.row_offset = E.num_rows;
+void editorFoldMark(erow* row, int hidden) {
+    if (row->hidden != hidden) {
+        row->hidden = hidden;
+        E.hidden_rows += hidden ? 1 : -1;
+    }
+}
 
-            saved_hl_line = current;
-            saved_hl = malloc(row->rsize);
-            memcpy(saved_hl, row->hl, row->rsize);
-            memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-            break;
+// Hide or show rows [from, to). The line indexes are updated row by row
+// when that is cheaper than indexing the rows from 'from' on again.
+void editorFoldSet(int from, int to, int hidden) {
+    int few = (to - from) * 32 < E.num_rows - from;
+    for (int r = from; r < to; r++) {
+        editorFoldMark(&E.row[r], hidden);
+        if (few) {
+            editorLineUpdateRow(&E.wrap_index, &E.row[r]);
+            editorLineUpdateRow(&E.fold_index, &E.row[r]);
         }
     }
-
-    // Note on restoring saved line after syntax highlighting search:
-    // malloc() memory is guaranteed to be free(), because when the user closes the
-    // search prompt by pressing Enter or Escape, editorPrompt() calls the callback,
-    // allowing hl to be restored before editorPrompt() finally returns.
-    // Also note that it’s impossible for saved_hl to get allocated (malloc) before
-    // its old value gets free() since it's always free() at the top of the function.
-    // Finally, it’s impossible for the user to edit the file between saving and
-    // restoring the hl, so saved_hl_line can be safely used as an index into E.row.
+    if (!few) {
+        editorLineIndexInvalidate(&E.wrap_index, from);
+        editorLineIndexInvalidate(&E.fold_index, from);
+    }
 }
 
-void editorFind() {
-    int saved_cx = E.cx;
-    int saved_cy = E.cy;
-    int saved_col_offset = E.col_offset;
-    int saved_row_offset = E.row_offset;
+// Open the fold hiding row 'at'
+void editorFoldReveal(int at) {
+    int from = at;
+    int to = at + 1;
+    while (from > 0 && E.row[from - 1].hidden) {
+        from--;
+    }
+    while (to < E.num_rows && E.row[to].hidden) {
+        to++;
+    }
+    editorFoldSet(from, to, 0);
+}
 
-    char* query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
+// Open the fold on the cursor's row, or fold the block the row starts
+void editorFoldToggle() {
+    if (E.cy >= E.num_rows) {
+        return;
+    }
+    int at = E.cy;
+    if (at + 1 < E.num_rows && E.row[at + 1].hidden) {
+        editorFoldReveal(at + 1);
+    } else {
+        // Rows past the frontier may still be highlighted for a state they
+        // no longer start in
+        editorSyntaxAdvance(E.num_rows);
+        int end = editorFoldEnd(at);
+        if (end <= at + 1) {
+            editorSetStatusMessage("Nothing to fold");
+            return;
+        }
+        editorFoldSet(at + 1, end, 1);
+        editorSetStatusMessage("Folded %d lines", end - at - 1);
+    }
+    // Keep the top row in place
+    E.line_offset = editorScreenLineOf(E.row_offset);
+}
 
-    if (query) {
-        free(query);
+// Fold every block at the top level, or open every fold if there are any.
+// Blocks are found by indentation alone here, which needs no highlighting,
+// so this is a single pass over the rows.
+void editorFoldAll() {
+    if (E.hidden_rows) {
+        for (int r = 0; r < E.num_rows; r++) {
+            editorFoldMark(&E.row[r], 0);
+        }
+        editorSetStatusMessage("Opened all folds");
     } else {
-        E.cx = saved_cx;
-        E.cy = saved_cy;
-        E.col_offset = saved_col_offset;
-        E.row_offset = saved_row_offset;
+        int folds = 0;
+        for (int r = 0; r < E.num_rows;) {
+            int end = (editorFoldIndent(&E.row[r]) == 0) ? editorFoldIndentEnd(r) : r + 1;
+            for (int h = r + 1; h < end; h++) {
+                editorFoldMark(&E.row[h], 1);
+            }
+            folds += end > r + 1;
+            r = end;
+        }
+        // Rather than open the cursor's fold again, move it to the top
+        if (E.cy < E.num_rows && E.row[E.cy].hidden) {
+            while (E.row[E.cy].hidden) {
+                E.cy--;
+            }
+            E.cx = 0;
+        }
+        editorSetStatusMessage("Folded %d blocks", folds);
     }
+    editorLineIndexInvalidate(&E.wrap_index, 0);
+    editorLineIndexInvalidate(&E.fold_index, 0);
+    E.line_offset = editorScreenLineOf(E.row_offset);
 }
 
 // ******** APPEND BUFFER ********
@@ -949,17 +4487,34 @@ void abuffFree(struct abuff* ab) {
 // ******** OUTPUT ********
 
 void editorScroll() {
+    // Whatever took the cursor into a fold (a search, say) opens it
+    if (E.cy < E.num_rows && E.row[E.cy].hidden) {
+        editorFoldReveal(E.cy);
+    }
+
     E.rx = 0;
     if (E.cy < E.num_rows) {
         E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
     }
 
-    if (E.cy < E.row_offset) {
-        E.row_offset = E.cy;
+    // Scroll by screen lines; the row offset follows the top line
+    int line = editorScreenLineOf(E.cy);
+    if (E.wrap && E.cy < E.num_rows) {
+        int start;
+        line += editorWrapSeek(&E.row[E.cy], INT_MAX, E.rx, &start);
+    }
+    if (line < E.line_offset) {
+        E.line_offset = line;
+    }
+    if (line >= E.line_offset + E.screen_rows) {
+        E.line_offset = line - E.screen_rows + 1;
     }
 
-    if (E.cy >= E.row_offset + E.screen_rows) {
-        E.row_offset = E.cy - E.screen_rows + 1;
+    int sub;
+    E.row_offset = editorScreenFindLine(E.line_offset, &sub);
+    if (E.wrap) {
+        E.col_offset = 0;
+        return;
     }
 
     if (E.rx < E.col_offset) {
@@ -971,78 +4526,314 @@ void editorScroll() {
     }
 }
 
-void editorDrawRows(struct abuff* ab) {
-    for (int y = 0; y < E.screen_rows; y++) {
-        int file_row = y + E.row_offset;
+const char* editorRenderModeName(int mode) {
+    switch (mode) {
+        case RENDER_LEAN:
+            return "lean";
+        case RENDER_PLAIN:
+            return "plain";
+        default:
+            return "full";
+    }
+}
+
+// Copy 'cols' columns of a row's render and highlighting, starting at
+// column 'start', into line y of the view.
+void editorSnapshotRowSpan(struct editorView* view, int y, erow* row, int start, int cols) {
+    char* text = &view->text[y * view->line_cap];
+    unsigned char* hl = &view->hl[y * view->line_cap];
+    view->line_kind[y] = VIEW_TEXT;
+    editorSyntaxEnsure(row);
+
+    if (row->ascii) {
+        // Every byte is a column
+        int len = row->rsize - start;
+        if (len < 0) {
+            len = 0;
+        }
+        if (len > cols) {
+            len = cols;
+        }
+        view->line_len[y] = len;
+        if (len) {
+            memcpy(text, &row->render[start], len);
+            editorHlCopy(row, start, len, hl);
+        }
+        for (int k = editorOverlayFind(row->idx, start);
+                k < E.overlay_len && E.overlay[k].row == row->idx && E.overlay[k].start < start + len; k++) {
+            struct editorOverlay* o = &E.overlay[k];
+            int from = o->start > start ? o->start : start;
+            int to = o->end < start + len ? o->end : start + len;
+            memset(&hl[from - start], o->hl, to - from);
+        }
+        return;
+    }
+
+    // Walk render from the char covering column 'start', one whole char
+    // at a time. Halves of wide chars cut by the left edge show as spaces
+    // and ones cut by the right edge as '>'.
+    struct erowPos pos = editorRowSeek(row, row->size, start, INT_MAX);
+    int ri = pos.ri;
+    int col = pos.rx;
+    int len = 0;
+    int o = editorOverlayFind(row->idx, ri);
+    while (ri < row->rsize) {
+        unsigned int cp;
+        int n = editorUtf8Decode(&row->render[ri], row->rsize - ri, &cp);
+        int w = editorCharWidth(cp);
+        // Marks combining with the last char drawn still belong to it
+        if (col > start + cols || (col == start + cols && w > 0) || len + n > view->line_cap) {
+            break;
+        }
+
+        if (col < start) {
+            for (int k = start; k < col + w; k++) {
+                text[len] = ' ';
+                hl[len++] = HL_NORMAL;
+            }
+        } else if (col + w > start + cols) {
+            text[len] = '>';
+            hl[len++] = HL_NORMAL;
+        } else {
+            while (o < E.overlay_len && E.overlay[o].row == row->idx && E.overlay[o].end <= ri) {
+                o++;
+            }
+            int over = o < E.overlay_len && E.overlay[o].row == row->idx && E.overlay[o].start <= ri;
+            memcpy(&text[len], &row->render[ri], n);
+            memset(&hl[len], over ? E.overlay[o].hl : editorHlAt(row, ri), n);
+            len += n;
+        }
+        ri += n;
+        col += w;
+    }
+    view->line_len[y] = len;
+}
+
+// Capture what the screen should show right now. This is the only part of
+// drawing that looks at the editor state, so it runs on the input thread.
+struct editorView* editorSnapshotView() {
+    int rows = E.screen_rows;
+    int cols = E.screen_cols;
+
+    struct editorView* view = malloc(sizeof(struct editorView));
+    view->screen_rows = rows;
+    view->screen_cols = cols;
+    view->line_kind = malloc(sizeof(int) * rows);
+    view->line_len = malloc(sizeof(int) * rows);
+    // Up to 4 bytes of UTF-8 per column, with some room for combining marks
+    view->line_cap = cols * 4 + 16;
+    view->text = malloc(rows * view->line_cap);
+    view->hl = malloc(rows * view->line_cap);
+
+    // When wrapping, the top screen line can be partway through a row.
+    // Each line of a row is broken where the one before it ended.
+    int sub;
+    int file_row = editorScreenFindLine(E.line_offset, &sub);
+    int start = 0;
+    struct erowPos pos = {0, 0, 0};
+    if (E.wrap && file_row < E.num_rows) {
+        editorWrapSeek(&E.row[file_row], sub, INT_MAX, &start);
+        pos = editorRowSeek(&E.row[file_row], E.row[file_row].size, start, INT_MAX);
+    }
+
+    for (int y = 0; y < rows; y++) {
         if (file_row >= E.num_rows) {
+            view->line_kind[y] = (E.num_rows == 0 && y == rows / 3) ? VIEW_WELCOME : VIEW_TILDE;
+            file_row++;
+        } else if (E.wrap) {
+            erow* row = &E.row[file_row];
+            int next = editorWrapNext(row, &pos, start);
+            int width = (next >= 0 && next - start < cols) ? next - start : cols;
+            editorSnapshotRowSpan(view, y, row, start, width);
+            start = next;
+            if (next < 0) {
+                file_row = editorNextRow(file_row);
+                start = 0;
+                pos = (struct erowPos) {0, 0, 0};
+            }
+        } else {
+            editorSnapshotRowSpan(view, y, &E.row[file_row], E.col_offset, cols);
+            file_row = editorNextRow(file_row);
+        }
+    }
+
+    view->status_len = snprintf(view->status, sizeof(view->status), "%.20s - %d lines %s",
+            E.filename ? E.filename : "[No Name]",
+            E.num_rows,
+            E.dirty ? "(modified)" : "");
+    pthread_mutex_lock(&E.render_lock);
+    view->render_mode = E.render_mode;
+    pthread_mutex_unlock(&E.render_lock);
+
+    view->rstatus_len = snprintf(view->rstatus, sizeof(view->rstatus), "%s | %s | %d/%d",
+            editorRenderModeName(view->render_mode),
+            E.syntax ? E.syntax->file_type : "No FT",
+            E.cy + 1,
+            E.num_rows);
+
+    view->msg_len = 0;
+    if (time(NULL) - E.statusmsg_time < 5) {
+        view->msg_len = strlen(E.statusmsg);
+        memcpy(view->msg, E.statusmsg, view->msg_len);
+    }
+
+    view->cursor_y = editorScreenLineOf(E.cy) - E.line_offset;
+    view->cursor_x = E.rx - E.col_offset;
+    if (E.wrap && E.cy < E.num_rows) {
+        view->cursor_y += editorWrapSeek(&E.row[E.cy], INT_MAX, E.rx, &start);
+        view->cursor_x = E.rx - start;
+    }
+
+    view->input_time = E.key_time;
+    view->apply_time = 0;
+    return view;
+}
+
+void editorFreeView(struct editorView* view) {
+    free(view->line_kind);
+    free(view->line_len);
+    free(view->text);
+    free(view->hl);
+    free(view);
+}
+
+// Append 'n' copies of 'c'. Long runs go out as the char and a REP of the
+// rest, or, for spaces drawn with default attributes ('plain'), as an ECH
+// to blank them and a cursor move past them.
+void editorDrawRun(struct abuff* ab, char c, int n, int plain) {
+    char buff[32];
+    if (E.term_rep && n > EDI_RUN_MIN) {
+        abuffAppend(ab, &c, 1);
+        int len = snprintf(buff, sizeof(buff), "\x1b[%db", n - 1);
+        abuffAppend(ab, buff, len);
+    } else if (E.term_ech && plain && c == ' ' && n > 2 * EDI_RUN_MIN) {
+        int len = snprintf(buff, sizeof(buff), "\x1b[%dX\x1b[%dC", n, n);
+        abuffAppend(ab, buff, len);
+    } else {
+        while (n--) {
+            abuffAppend(ab, &c, 1);
+        }
+    }
+}
+
+// Append printable ASCII, sending long runs of one char with editorDrawRun()
+void editorDrawText(struct abuff* ab, const char* s, int len) {
+    if (!E.term_rep) {
+        abuffAppend(ab, s, len);
+        return;
+    }
+
+    int start = 0;
+    for (int i = 0; i < len; ) {
+        int k = i + 1;
+        while (k < len && s[k] == s[i]) {
+            k++;
+        }
+        if (k - i > EDI_RUN_MIN) {
+            abuffAppend(ab, &s[start], i - start);
+            editorDrawRun(ab, s[i], k - i, 0);
+            start = k;
+        }
+        i = k;
+    }
+    abuffAppend(ab, &s[start], len - start);
+}
+
+// Draw one line of text, switching colors as the highlighting changes.
+void editorDrawRowSpan(struct abuff* ab, char* c, unsigned char* hl, int len, int color) {
+    // current_color is -1 for default text color, else it's set to editorSyntaxToColor()'s last return val.
+    // When color changes, print the escape sequence for that color and set current_color to the new color.
+    // When going from highlighted text back to HL_NORMAL text, print out the <esc>[39m escape sequence and
+    // set current_color to -1.
+    int current_color = -1;
+    int n;
+    for (int j = 0; j < len; j += n) {
+        // Only bytes past ASCII need decoding; C1 controls and bytes that
+        // are not UTF-8 show as an inverted '?' like other controls
+        unsigned char u = c[j];
+        n = 1;
+        int ctrl = u < 0x20 || u == 0x7F;
+        if (u >= 0x80) {
+            unsigned int cp;
+            n = editorUtf8Decode(&c[j], len - j, &cp);
+            ctrl = cp < 0xA0 || cp == EDI_UTF8_INVALID;
+        }
+
+        if (ctrl) {
+            char sym = (u <= 26) ? '@' + u : '?';
+            abuffAppend(ab, "\x1b[7m", 4); // Switch to inverted colors
+            abuffAppend(ab, &sym, 1);      // Print the 'non-printable' character
+            abuffAppend(ab, "\x1b[m", 3);  // Clear ALL text formatting
+            // Restore previous (before non-printable char) text formatting
+            if (current_color != -1) {
+                char buff[16];
+                int clen = snprintf(buff, sizeof(buff), "\x1b[%dm", current_color);
+                abuffAppend(ab, buff, clen);
+            }
+            continue;
+        }
+
+        if (!color || hl[j] == HL_NORMAL) {
+            if (current_color != -1) {
+                abuffAppend(ab, "\x1b[39m", 5);
+                current_color = -1;
+            }
+        } else {
+            int color = editorSyntaxToColor(hl[j]);
+            if (current_color != color) {
+                current_color = color;
+                char buff[16];
+                int clen = snprintf(buff, sizeof(buff), "\x1b[%dm", color);
+                abuffAppend(ab, buff, clen);
+            }
+        }
+
+        // Take the whole run of printable ASCII with the same highlighting
+        if (u < 0x80) {
+            while (j + n < len && (!color || hl[j + n] == hl[j]) && c[j + n] >= 0x20 && c[j + n] < 0x7F) {
+                n++;
+            }
+            editorDrawText(ab, &c[j], n);
+        } else {
+            abuffAppend(ab, &c[j], n);
+        }
+    }
+    if (current_color != -1) {
+        abuffAppend(ab, "\x1b[39m", 5);
+    }
+}
+
+void editorDrawRows(struct abuff* ab, struct editorView* view) {
+    for (int y = 0; y < view->screen_rows; y++) {
+        if (view->line_kind[y] == VIEW_WELCOME) {
             // Print welcome message
-            if (E.num_rows == 0 && y == E.screen_rows/3) {
-                char welcome[80];
-                const char* message = "EDItor -- version %s";
-                int welcome_len = snprintf(welcome, sizeof(welcome), message, EDI_VERSION);
-                // Truncate message if the terminal view is too small
-                if (welcome_len > E.screen_cols) {
-                    welcome_len = E.screen_cols;
-                }
-                int padding = (E.screen_cols - welcome_len) / 2;
-                if (padding) {
-                    abuffAppend(ab, "~", 1);
-                    padding--;
-                }
-                while (padding--) {
-                    abuffAppend(ab, " ", 1);
-                }
-                abuffAppend(ab, welcome, welcome_len);
-            } else {
+            char welcome[80];
+            const char* message = "EDItor -- version %s";
+            int welcome_len = snprintf(welcome, sizeof(welcome), message, EDI_VERSION);
+            // Truncate message if the terminal view is too small
+            if (welcome_len > view->screen_cols) {
+                welcome_len = view->screen_cols;
+            }
+            int padding = (view->screen_cols - welcome_len) / 2;
+            if (padding) {
                 abuffAppend(ab, "~", 1);
+                padding--;
             }
+            editorDrawRun(ab, ' ', padding, 1);
+            abuffAppend(ab, welcome, welcome_len);
+        } else if (view->line_kind[y] == VIEW_TILDE) {
+            abuffAppend(ab, "~", 1);
         } else {
-            int len = E.row[file_row].rsize - E.col_offset;
-            if (len < 0) {
-                len = 0;
-            }
-            if (len > E.screen_cols) {
-                len = E.screen_cols;
-            }
-
-
-            // current_color is -1 for default text color, else it's set to editorSyntaxToColor()'s last return val.
-            // When color changes, print the escape sequence for that color and set current_color to the new color.
-            // When going from highlighted text back to HL_NORMAL text, print out the <esc>[39m escape sequence and
-            // set current_color to -1.
-            char* c = &E.row[file_row].render[E.col_offset];
-            unsigned char* hl = &E.row[file_row].hl[E.col_offset];
-            int current_color = -1;
-            for (int j = 0; j < len; j++) {
-                if (iscntrl(c[j])) {
-                    char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-                    abuffAppend(ab, "\x1b[7m", 4); // Switch to inverted colors
-                    abuffAppend(ab, &sym, 1);      // Print the 'non-printable' character
-                    abuffAppend(ab, "\x1b[m", 3);  // Clear ALL text formatting
-                    // Restore previous (before non-printable char) text formatting
-                    if (current_color != -1) {
-                        char buff[16];
-                        int clen = snprintf(buff, sizeof(buff), "\x1b[%dm", current_color);
-                        abuffAppend(ab, buff, clen);
-                    }
-                } else if (hl[j] == HL_NORMAL) {
-                    if (current_color != -1) {
-                        abuffAppend(ab, "\x1b[39m", 5);
-                        current_color = -1;
-                    }
-                    abuffAppend(ab, &c[j], 1);
-                } else {
-                    int color = editorSyntaxToColor(hl[j]);
-                    if (current_color != color) {
-                        current_color = color;
-                        char buff[16];
-                        int clen = snprintf(buff, sizeof(buff), "\x1b[%dm", color);
-                        abuffAppend(ab, buff, clen);
-                    }
-                    abuffAppend(ab, &c[j], 1);
-                }
+            // Trailing spaces only show the default background, which the
+            // erase below paints anyway
+            int at = y * view->line_cap;
+            int len = view->line_len[y];
+            while (len > 0 && view->text[at + len - 1] == ' ') {
+                len--;
             }
-            abuffAppend(ab, "\x1b[39m", 5);
+            int color = view->render_mode == RENDER_FULL ||
+                        (view->render_mode == RENDER_LEAN && y == view->cursor_y);
+            editorDrawRowSpan(ab, &view->text[at], &view->hl[at], len, color);
         }
 
         // Write a 3-byte escape sequence to the terminal to clear the screen.
@@ -1053,86 +4844,637 @@ void editorDrawRows(struct abuff* ab) {
         // the right of the cursor. [1K clears the line to the left of the cursor.
         abuffAppend(ab, "\x1b[K", 3); // K: Erase in line
 
-        abuffAppend(ab, "\r\n", 2);
+        abuffAppend(ab, "\r\n", 2);
+    }
+}
+
+void editorDrawStatusBar(struct abuff* ab, struct editorView* view) {
+    // m command: Select Graphic Rendition
+    abuffAppend(ab, "\x1b[7m", 4); // Switch to inverted terminal colors
+    int len = view->status_len;
+    int rlen = view->rstatus_len;
+    if (len > view->screen_cols) {
+        len = view->screen_cols;
+    }
+    abuffAppend(ab, view->status, len);
+    // The padding is drawn inverted, so it has to be written, not erased
+    int padding = view->screen_cols - len;
+    if (padding >= rlen) {
+        editorDrawRun(ab, ' ', padding - rlen, 0);
+        abuffAppend(ab, view->rstatus, rlen);
+    } else {
+        editorDrawRun(ab, ' ', padding, 0);
+    }
+    abuffAppend(ab, "\x1b[m", 3); // Switch to normal terminal colors
+    abuffAppend(ab, "\r\n", 2);
+}
+
+void editorDrawMessageBar(struct abuff* ab, struct editorView* view) {
+    abuffAppend(ab, "\x1b[K", 3);
+    int msg_len = view->msg_len;
+    if (msg_len > view->screen_cols) {
+        msg_len = view->screen_cols;
+    }
+    abuffAppend(ab, view->msg, msg_len);
+}
+
+// Build the escape sequences for a whole frame from a view
+void editorDrawFrame(struct abuff* ab, struct editorView* view) {
+    // With mode 2026 the terminal shows nothing of the frame until it ends,
+    // so it never paints one half written and paints each frame once
+    if (E.sync_output) {
+        abuffAppend(ab, "\x1b[?2026h", 8); // Begin synchronized update
+    }
+
+    // l and h commands (Reset Mode, Set Mode) are used to enable/disable
+    // various terminal features.
+    abuffAppend(ab, "\x1b[?25l", 6); // Hide cursor
+
+    // H takes 2 parameters (row and col numbers). Default arguments are 1
+    // and 1, which places the cursor at the top of the screen.
+    abuffAppend(ab, "\x1b[H", 3);  // H: Cursor Position
+
+    editorDrawRows(ab, view);
+    editorDrawStatusBar(ab, view);
+    editorDrawMessageBar(ab, view);
+
+    // Create a H command escape sequence to place the cursor at
+    // the desired location stored in the view, using the
+    // snprintf function to append to \xb[%d;%d ==> \xb[10;16 (for example)
+    char buff[32];
+    snprintf(buff, sizeof(buff), "\x1b[%d;%dH", view->cursor_y + 1, view->cursor_x + 1);
+    abuffAppend(ab, buff, strlen(buff));
+
+    abuffAppend(ab, "\x1b[?25h", 6); // Show cursor
+
+    if (E.sync_output) {
+        abuffAppend(ab, "\x1b[?2026l", 8); // End synchronized update
+    }
+}
+
+// Hand the current screen to the render thread. The input thread never
+// waits for drawing; an older view not drawn yet is simply replaced.
+void editorRefreshScreen() {
+    editorScroll();
+
+    int sub;
+    int top = editorScreenFindLine(E.line_offset, &sub);
+
+    editorHlCollect();
+    editorOverlayBuild(top, sub);
+    // Finding the bracket pair shares the budget of the rows shown, as it
+    // only highlights those
+    E.hl_deadline = editorNow() + EDI_HL_BUDGET;
+    editorBracketOverlay(top, top + E.screen_rows);
+    struct editorView* view = editorSnapshotView();
+    E.hl_deadline = 0;
+
+    editorHlPrefetch(top, top + E.screen_rows);
+    view->apply_time = editorNow();
+    if (E.key_time) {
+        double latency = view->apply_time - E.key_time;
+        E.stats.applied++;
+        E.stats.input_apply_sum += latency;
+        if (latency > E.stats.input_apply_max) {
+            E.stats.input_apply_max = latency;
+        }
+        E.key_time = 0;
+    }
+
+    pthread_mutex_lock(&E.render_lock);
+    if (E.view_next) {
+        editorFreeView(E.view_next);
+        E.stats.views_skipped++;
+    }
+    E.view_next = view;
+    pthread_mutex_unlock(&E.render_lock);
+
+    write(E.render_wake[1], "", 1);
+}
+
+void editorSetStatusMessage(const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
+    va_end(ap);
+    E.statusmsg_time = time(NULL);
+}
+
+// ******** RENDER THREAD ********
+
+// Open a second, non-blocking handle on the terminal for frame output.
+// It has its own file status flags, so stdin keeps its blocking reads.
+void editorOpenOutput() {
+    char* tty = ttyname(STDOUT_FILENO);
+    E.out_fd = tty ? open(tty, O_WRONLY | O_NONBLOCK | O_NOCTTY) : -1;
+    if (E.out_fd == -1) {
+        E.out_fd = STDOUT_FILENO;
+    }
+}
+
+// Pick the render mode from the link measurements, under render_lock. The
+// mode steps down as soon as the link looks slow, but only steps back up
+// once it is well within the limits, so it does not flap between two.
+int editorLinkMode(double slack) {
+    double delay = E.link_delay;
+    double rate = E.link_rate;
+    if (delay > EDI_PLAIN_DELAY * slack || (rate && rate < EDI_PLAIN_RATE / slack)) {
+        return RENDER_PLAIN;
+    }
+    if (delay > EDI_LEAN_DELAY * slack || (rate && rate < EDI_LEAN_RATE / slack)) {
+        return RENDER_LEAN;
+    }
+    return RENDER_FULL;
+}
+
+void editorPickRenderMode() {
+    int worse = editorLinkMode(1);
+    int better = editorLinkMode(0.5);
+    if (worse > E.render_mode) {
+        E.render_mode = worse;
+    } else if (better < E.render_mode) {
+        E.render_mode = better;
+    }
+}
+
+// Fold a frame delivery time into the link measurements, under render_lock
+void editorLinkDelay(double delay) {
+    E.link_delay = E.link_delay ? 0.7 * E.link_delay + 0.3 * delay : delay;
+    // Frames arriving this fast mean an old slow rate no longer holds
+    if (delay < EDI_LEAN_DELAY / 2) {
+        E.link_rate = 0;
+    }
+    editorPickRenderMode();
+}
+
+// The terminal answered the position query sent after a frame. Called on
+// the input thread.
+void editorLinkReport() {
+    if (!E.render_started) {
+        return;
+    }
+    pthread_mutex_lock(&E.render_lock);
+    if (E.report_sent) {
+        editorLinkDelay(editorNow() - E.report_sent);
+        E.report_sent = 0;
+        E.report_seen = 1;
+    }
+    pthread_mutex_unlock(&E.render_lock);
+
+    // A frame may be held back waiting for this
+    write(E.render_wake[1], "", 1);
+}
+
+// A frame is fully written. If writing it blocked, the rate it went out at
+// from then on is what the link manages.
+void editorLinkFrameDone() {
+    if (!E.out_blocked) {
+        return;
+    }
+    double elapsed = editorNow() - E.out_blocked;
+    if (elapsed > 0) {
+        double rate = (E.out_len - E.out_blocked_pos) / elapsed;
+        pthread_mutex_lock(&E.render_lock);
+        E.link_rate = E.link_rate ? 0.7 * E.link_rate + 0.3 * rate : rate;
+        editorPickRenderMode();
+        pthread_mutex_unlock(&E.render_lock);
+    }
+    E.out_blocked = 0;
+}
+
+// Write as much of the frame in flight as the terminal accepts without
+// blocking. Frames are only built once the previous one is fully out, so
+// under backpressure intermediate views are skipped, not queued.
+void editorFlushOutput() {
+    while (E.out_buf) {
+        int n = write(E.out_fd, &E.out_buf[E.out_pos], E.out_len - E.out_pos);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                if (!E.out_blocked) {
+                    E.out_blocked = editorNow();
+                    E.out_blocked_pos = E.out_pos;
+                }
+                return;
+            }
+            // Any other error loses this frame; the next one redraws everything
+            n = E.out_len - E.out_pos;
+        }
+
+        E.out_pos += n;
+        if (E.out_pos == E.out_len) {
+            editorLinkFrameDone();
+            free(E.out_buf);
+            E.out_buf = NULL;
+        }
+    }
+}
+
+void editorRecordPaint(struct editorView* view) {
+    double latency = editorNow() - view->apply_time;
+    E.stats.frames++;
+    E.stats.apply_paint_sum += latency;
+    if (latency > E.stats.apply_paint_max) {
+        E.stats.apply_paint_max = latency;
+    }
+}
+
+void* editorRenderThread(void* arg) {
+    (void) arg;
+    struct editorView* painting = NULL; // View whose frame is being written
+
+    while (1) {
+        struct pollfd fds[2] = {
+            { E.render_wake[0], POLLIN, 0 },
+            { E.out_fd, E.out_buf ? POLLOUT : 0, 0 }
+        };
+        // Wake up now and then to time out an unanswered position query
+        pthread_mutex_lock(&E.render_lock);
+        int timeout = E.report_sent ? 100 : -1;
+        pthread_mutex_unlock(&E.render_lock);
+        poll(fds, 2, timeout);
+
+        char drain[64];
+        while (read(E.render_wake[0], drain, sizeof(drain)) > 0) {
+        }
+
+        editorFlushOutput();
+        if (painting && !E.out_buf) {
+            editorRecordPaint(painting);
+            editorFreeView(painting);
+            painting = NULL;
+        }
+        if (E.out_buf) {
+            continue;
+        }
+
+        pthread_mutex_lock(&E.render_lock);
+        double now = editorNow();
+        if (E.report_sent && now - E.report_sent > EDI_REPORT_TIMEOUT) {
+            // Only a terminal known to answer makes a missing answer mean
+            // a slow link
+            if (E.report_seen) {
+                editorLinkDelay(now - E.report_sent);
+            }
+            E.report_sent = 0;
+        }
+        int quit = E.render_quit;
+        // On a slow link keep one frame in flight: the next one waits until
+        // the terminal has answered the query after the last
+        struct editorView* view = NULL;
+        if (quit || E.render_mode == RENDER_FULL || !E.report_sent) {
+            view = E.view_next;
+            E.view_next = NULL;
+        }
+        pthread_mutex_unlock(&E.render_lock);
+
+        if (quit) {
+            if (view) {
+                editorFreeView(view);
+            }
+            return NULL;
+        }
+
+        if (view) {
+            struct abuff ab = ABUFF_INIT;
+            editorDrawFrame(&ab, view);
+
+            // Nothing on screen changed (a key that moved nothing, say), so
+            // spare the terminal from processing the same frame again
+            if (E.last_frame && ab.len == E.last_len && !memcmp(ab.b, E.last_frame, ab.len)) {
+                abuffFree(&ab);
+                editorRecordPaint(view);
+                editorFreeView(view);
+                continue;
+            }
+
+            free(E.last_frame);
+            E.last_frame = malloc(ab.len);
+            memcpy(E.last_frame, ab.b, ab.len);
+            E.last_len = ab.len;
+
+            // Ask where the cursor is; the answer comes once the terminal
+            // has the whole frame
+            pthread_mutex_lock(&E.render_lock);
+            if (!E.report_sent) {
+                abuffAppend(&ab, "\x1b[6n", 4);
+                E.report_sent = editorNow();
+            }
+            pthread_mutex_unlock(&E.render_lock);
+
+            E.out_buf = ab.b;
+            E.out_len = ab.len;
+            E.out_pos = 0;
+            painting = view;
+        }
+    }
+}
+
+void editorStartRender() {
+    editorOpenOutput();
+    E.out_buf = NULL;
+    E.out_blocked = 0;
+    E.last_frame = NULL;
+    E.report_sent = 0;
+    E.report_seen = 0;
+    E.link_delay = 0;
+    E.link_rate = 0;
+    E.render_mode = RENDER_FULL;
+    E.view_next = NULL;
+    E.render_quit = 0;
+
+    if (pipe(E.render_wake) == -1) {
+        die("pipe");
+    }
+    fcntl(E.render_wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(E.render_wake[1], F_SETFL, O_NONBLOCK);
+
+    pthread_mutex_init(&E.render_lock, NULL);
+    if (pthread_create(&E.render_thread, NULL, editorRenderThread, NULL) != 0) {
+        die("pthread_create");
+    }
+    E.render_started = 1;
+}
+
+// Let the render thread finish the frame it is writing and wait for it to
+// exit, so nothing else written to the terminal lands inside a frame.
+void editorStopRender() {
+    if (!E.render_started) {
+        return;
+    }
+    E.render_started = 0;
+
+    pthread_mutex_lock(&E.render_lock);
+    E.render_quit = 1;
+    pthread_mutex_unlock(&E.render_lock);
+    write(E.render_wake[1], "", 1);
+
+    pthread_join(E.render_thread, NULL);
+}
+
+void editorPrintStats() {
+    struct editorStats* st = &E.stats;
+    fprintf(stderr, "edi: %d frames painted, %d views skipped\n", st->frames, st->views_skipped);
+    fprintf(stderr, "edi: input to apply: avg %.3f ms, max %.3f ms over %d keys\n",
+            st->applied ? st->input_apply_sum / st->applied : 0, st->input_apply_max, st->applied);
+    fprintf(stderr, "edi: apply to paint: avg %.3f ms, max %.3f ms\n",
+            st->frames ? st->apply_paint_sum / st->frames : 0, st->apply_paint_max);
+    fprintf(stderr, "edi: link: frame delivery %.1f ms, %.1f KB/s while blocked, %s mode\n",
+            E.link_delay, E.link_rate, editorRenderModeName(E.render_mode));
+    fprintf(stderr, "edi: highlight worker: %d rows prefetched, %d applied, %d stale\n",
+            st->hl_prefetched, st->hl_applied, st->hl_stale);
+    fprintf(stderr, "edi: comment states: %d chunks scanned in parallel, %d guessed wrong\n",
+            st->hl_chunks, st->hl_chunks_wrong);
+    long stored, dense;
+    editorHlMemory(&stored, &dense);
+    fprintf(stderr, "edi: highlighting held in %.1f KB, %.1f KB at a byte per char\n",
+            stored / 1e3, dense / 1e3);
+}
+
+// ******** HIGHLIGHT WORKER ********
+
+// Highlight one batch of copied rows. Rows are scanned in order so a job
+// with start == -1 carries on from the end state of the job before it.
+void editorHlRunJobs(struct editorHlJob* jobs, int len) {
+    int in_comment = 0;
+    for (int k = 0; k < len; k++) {
+        struct editorHlJob* job = &jobs[k];
+        if (job->start == -1) {
+            job->start = in_comment;
+        }
+        erow row = {0};
+        row.render = job->render;
+        row.rsize = job->rsize;
+        row.hl = job->hl;
+        struct editorHlState st = {0, job->start, 1};
+        editorSyntaxScan(&row, 0, row.rsize, &st);
+        job->end = st.in_comment;
+        job->runs = editorHlRuns(job->hl, job->rsize, &job->nruns);
+        if (job->runs) {
+            free(job->hl);
+            job->hl = NULL;
+        }
+        in_comment = st.in_comment;
     }
 }
 
-void editorDrawStatusBar(struct abuff* ab) {
-    // m command: Select Graphic Rendition
-    abuffAppend(ab, "\x1b[7m", 4); // Switch to inverted terminal colors
-    char status[80], rstatus[80];
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-            E.filename ? E.filename : "[No Name]",
-            E.num_rows,
-            E.dirty ? "(modified)" : "");
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
-            E.syntax ? E.syntax->file_type : "No FT",
-            E.cy + 1,
-            E.num_rows);
-    if (len > E.screen_cols) {
-        len = E.screen_cols;
+void editorHlFreeJobs(struct editorHlJob* jobs, int len) {
+    for (int k = 0; k < len; k++) {
+        free(jobs[k].render);
+        free(jobs[k].hl);
+        free(jobs[k].runs);
     }
-    abuffAppend(ab, status, len);
-    while (len < E.screen_cols) {
-        if (E.screen_cols - len == rlen) {
-            abuffAppend(ab, rstatus, rlen);
+    free(jobs);
+}
+
+// The worker takes the newest batch, highlights it without the lock and
+// leaves the result in hl_done for the input thread to apply. E.syntax
+// only changes while the worker is idle (see editorHlWorkerSync).
+void* editorHlThread(void* arg) {
+    (void) arg;
+    pthread_mutex_lock(&E.hl_lock);
+    while (1) {
+        while (!E.hl_quit && E.hl_jobs == NULL) {
+            pthread_cond_wait(&E.hl_cond, &E.hl_lock);
+        }
+        if (E.hl_quit) {
             break;
-        } else {
-            abuffAppend(ab, " ", 1);
-            len++;
         }
+        struct editorHlJob* jobs = E.hl_jobs;
+        int len = E.hl_jobs_len;
+        E.hl_jobs = NULL;
+        E.hl_busy = 1;
+        pthread_mutex_unlock(&E.hl_lock);
+
+        editorHlRunJobs(jobs, len);
+
+        pthread_mutex_lock(&E.hl_lock);
+        if (E.hl_done) {
+            editorHlFreeJobs(E.hl_done, E.hl_done_len);
+        }
+        E.hl_done = jobs;
+        E.hl_done_len = len;
+        E.hl_busy = 0;
+        pthread_cond_broadcast(&E.hl_cond);
     }
-    abuffAppend(ab, "\x1b[m", 3); // Switch to normal terminal colors
-    abuffAppend(ab, "\r\n", 2);
+    pthread_mutex_unlock(&E.hl_lock);
+    return NULL;
 }
 
-void editorDrawMessageBar(struct abuff* ab) {
-    abuffAppend(ab, "\x1b[K", 3);
-    int msg_len = strlen(E.statusmsg);
-    if (msg_len > E.screen_cols) {
-        msg_len = E.screen_cols;
-    }
-    if (msg_len && time(NULL) - E.statusmsg_time < 5) {
-        abuffAppend(ab, E.statusmsg, msg_len);
+// A thread of the pool: scan the chunks of each move of the frontier it
+// gets to, for as long as the editor runs
+void* editorHlPoolThread(void* arg) {
+    (void) arg;
+    pthread_mutex_lock(&E.hl_pool_lock);
+    while (1) {
+        while (E.hl_chunks_next == E.hl_chunks_len) {
+            pthread_cond_wait(&E.hl_pool_cond, &E.hl_pool_lock);
+        }
+        editorHlPoolRun();
     }
+    return NULL;
 }
 
-void editorRefreshScreen() {
-    editorScroll();
-
-    struct abuff ab = ABUFF_INIT;
+void editorStartHlPool() {
+    E.hl_chunks = NULL;
+    E.hl_chunks_len = 0;
+    E.hl_chunks_next = 0;
+    E.hl_chunks_left = 0;
+    pthread_mutex_init(&E.hl_pool_lock, NULL);
+    pthread_cond_init(&E.hl_pool_cond, NULL);
+    pthread_cond_init(&E.hl_pool_done, NULL);
+    E.hl_pool = malloc(sizeof(pthread_t) * E.hl_threads);
+    // Set before any thread starts: it says whether to take the lock
+    E.hl_pool_len = E.hl_threads - 1;
+    for (int k = 0; k < E.hl_pool_len; k++) {
+        if (pthread_create(&E.hl_pool[k], NULL, editorHlPoolThread, NULL) != 0) {
+            die("pthread_create");
+        }
+    }
+}
 
-    // l and h commands (Reset Mode, Set Mode) are used to enable/disable
-    // various terminal features.
-    abuffAppend(&ab, "\x1b[?25l", 6); // Hide cursor
+void editorStartHlWorker() {
+    E.hl_jobs = NULL;
+    E.hl_done = NULL;
+    E.hl_busy = 0;
+    E.hl_quit = 0;
+    pthread_mutex_init(&E.hl_lock, NULL);
+    pthread_cond_init(&E.hl_cond, NULL);
+    if (pthread_create(&E.hl_thread, NULL, editorHlThread, NULL) != 0) {
+        die("pthread_create");
+    }
+    E.hl_started = 1;
+}
 
-    // H takes 2 parameters (row and col numbers). Default arguments are 1
-    // and 1, which places the cursor at the top of the screen.
-    abuffAppend(&ab, "\x1b[H", 3);  // H: Cursor Position
+// Drop everything queued or finished and wait for the worker to go idle.
+// Called before anything the worker reads besides its own jobs changes.
+void editorHlWorkerSync() {
+    if (!E.hl_started) {
+        return;
+    }
+    pthread_mutex_lock(&E.hl_lock);
+    while (E.hl_busy) {
+        pthread_cond_wait(&E.hl_cond, &E.hl_lock);
+    }
+    if (E.hl_jobs) {
+        editorHlFreeJobs(E.hl_jobs, E.hl_jobs_len);
+        E.hl_jobs = NULL;
+    }
+    if (E.hl_done) {
+        editorHlFreeJobs(E.hl_done, E.hl_done_len);
+        E.hl_done = NULL;
+    }
+    pthread_mutex_unlock(&E.hl_lock);
+}
 
-    editorDrawRows(&ab);
-    editorDrawStatusBar(&ab);
-    editorDrawMessageBar(&ab);
+// Take in what the worker finished. A result only counts if its row has
+// not changed since it was copied (same epoch) and, where the row's start
+// state is already known, it was highlighted for that state. Rows past the
+// frontier take it as their checkpoint like any other highlighting.
+void editorHlCollect() {
+    if (!E.hl_started) {
+        return;
+    }
+    pthread_mutex_lock(&E.hl_lock);
+    struct editorHlJob* jobs = E.hl_done;
+    int len = E.hl_done_len;
+    E.hl_done = NULL;
+    pthread_mutex_unlock(&E.hl_lock);
+    if (jobs == NULL) {
+        return;
+    }
 
-    // Create a H command escape sequence to place the cursor at
-    // the desired location stored in the editorConfig, using the
-    // snprintf function to append to \xb[%d;%d ==> \xb[10;16 (for example)
-    char buff[32];
-    snprintf(buff, sizeof(buff), "\x1b[%d;%dH", (E.cy - E.row_offset) + 1, (E.rx - E.col_offset) + 1);
-    abuffAppend(&ab, buff, strlen(buff));
+    for (int k = 0; k < len; k++) {
+        struct editorHlJob* job = &jobs[k];
+        if (job->idx >= E.num_rows) {
+            E.stats.hl_stale++;
+            continue;
+        }
+        erow* row = &E.row[job->idx];
+        if (row->hl_epoch != job->epoch ||
+                (job->idx <= E.hl_frontier && job->start != editorSyntaxStartState(job->idx))) {
+            E.stats.hl_stale++;
+            continue;
+        }
+        if (row->hl_ready && row->hl_start_comment == job->start) {
+            continue;
+        }
+        editorHlFree(row);
+        row->hl = job->hl;
+        row->hl_runs = job->runs;
+        row->hl_nruns = job->nruns;
+        job->hl = NULL;
+        job->runs = NULL;
+        row->hl_start_comment = job->start;
+        row->hl_ready = 1;
+        editorBracketTouch(row);
+        editorSyntaxSetOpenComment(row, job->end);
+        E.stats.hl_applied++;
+    }
+    editorHlFreeJobs(jobs, len);
+}
 
-    abuffAppend(&ab, "\x1b[?25h", 6); // Show cursor
+// Hand the worker the rows within EDI_HL_PREFETCH screens above and below
+// rows [top, bottom) that it would have to highlight when scrolled to. A
+// batch is only sent once the worker is done with the last one.
+void editorHlPrefetch(int top, int bottom) {
+    if (!E.hl_started || E.syntax == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&E.hl_lock);
+    int busy = E.hl_busy || E.hl_jobs || E.hl_done;
+    pthread_mutex_unlock(&E.hl_lock);
+    if (busy) {
+        return;
+    }
 
-    write(STDOUT_FILENO, ab.b, ab.len);
-    abuffFree(&ab);
-}
+    int reach = E.screen_rows * EDI_HL_PREFETCH;
+    int ranges[2][2] = {
+        {top - reach, top},
+        {bottom, bottom + reach}
+    };
+    struct editorHlJob* jobs = NULL;
+    int len = 0;
+    long bytes = 0;
+    for (int r = 0; r < 2; r++) {
+        int from = ranges[r][0] < 0 ? 0 : ranges[r][0];
+        int to = ranges[r][1] > E.num_rows ? E.num_rows : ranges[r][1];
+        // Past the frontier this start state is only a guess, just like
+        // it is for rows shown there. Once one row is queued the rest of
+        // the range is too, each starting where the one before ends.
+        int queued = 0;
+        for (int i = from; i < to && bytes < EDI_HL_PREFETCH_BYTES; i++) {
+            erow* row = &E.row[i];
+            int start = editorSyntaxStartState(i);
+            if (!queued && row->hl_ready && row->hl_start_comment == start) {
+                continue;
+            }
+            jobs = realloc(jobs, sizeof(struct editorHlJob) * (len + 1));
+            struct editorHlJob* job = &jobs[len++];
+            job->idx = i;
+            job->epoch = row->hl_epoch;
+            job->start = queued ? -1 : start;
+            job->rsize = row->rsize;
+            job->render = malloc(row->rsize + 1);
+            memcpy(job->render, row->render, row->rsize + 1);
+            job->hl = malloc(row->rsize + 1);
+            job->runs = NULL;
+            bytes += row->rsize;
+            queued = 1;
+        }
+    }
+    if (len == 0) {
+        return;
+    }
 
-void editorSetStatusMessage(const char* fmt, ...) {
-    va_list ap;
-    va_start(ap, fmt);
-    vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
-    va_end(ap);
-    E.statusmsg_time = time(NULL);
+    E.stats.hl_prefetched += len;
+    pthread_mutex_lock(&E.hl_lock);
+    E.hl_jobs = jobs;
+    E.hl_jobs_len = len;
+    pthread_cond_signal(&E.hl_cond);
+    pthread_mutex_unlock(&E.hl_lock);
 }
 
 // ******** INPUT ********
@@ -1169,8 +5511,9 @@ char* editorPrompt(char* prompt, void (*callback)(char*, int)) {
                 }
                 return buff;
             }
-        } else if (!iscntrl(c) &&  c < 128) { // Make sure input isn't a special key in editorKey
-                                              // by making sure it is less than 128
+        } else if (!iscntrl(c) &&  c < 256) { // Make sure input isn't a special key in editorKey
+                                              // by making sure it is less than 256; bytes past
+                                              // 127 are parts of UTF-8 sequences
             if (buff_len == buff_size - 1) {
                 buff_size *= 2;
                 buff = realloc(buff, buff_size);
@@ -1190,29 +5533,34 @@ void editorMoveCursor(int key) {
 
     switch (key) {
         case ARROW_LEFT:
+            // Move by codepoints, taking marks that combine with a char along
             if (E.cx != 0) {
-                E.cx--;
+                do {
+                    E.cx = editorRowCharStart(row, E.cx - 1);
+                } while (E.cx > 0 && editorRowZeroWidthAt(row, E.cx));
             } else if (E.cy > 0) {
-                E.cy--;
+                E.cy = editorPrevRow(E.cy);
                 E.cx = E.row[E.cy].size;
             }
             break;
         case ARROW_RIGHT:
             if (row && E.cx < row->size) {
-                E.cx++;
+                do {
+                    E.cx = editorRowNextChar(row, E.cx);
+                } while (editorRowZeroWidthAt(row, E.cx));
             } else if (row && E.cx == row->size) {
-                E.cy++;
+                E.cy = editorNextRow(E.cy);
                 E.cx = 0;
             }
             break;
         case ARROW_UP:
             if (E.cy != 0) {
-                E.cy--;
+                E.cy = editorPrevRow(E.cy);
             }
             break;
         case ARROW_DOWN:
             if (E.cy < E.num_rows) {
-                E.cy++;
+                E.cy = editorNextRow(E.cy);
             }
             break;
     }
@@ -1222,6 +5570,10 @@ void editorMoveCursor(int key) {
     if (E.cx > row_len) {
         E.cx = row_len;
     }
+    // Moving up or down can land inside a multibyte char
+    if (row) {
+        E.cx = editorRowCharStart(row, E.cx);
+    }
 }
 
 void editorProcessKeypress() {
@@ -1241,6 +5593,7 @@ void editorProcessKeypress() {
                 quit_times--;
                 return;
             }
+            editorStopRender();
             write(STDOUT_FILENO, "\x1b[2J", 4);
             write(STDOUT_FILENO, "\x1b[H", 3);
             exit(0);
@@ -1263,6 +5616,25 @@ void editorProcessKeypress() {
             editorFind();
             break;
 
+        case CTRL_KEY(']'):
+            editorBracketJump();
+            break;
+
+        case CTRL_KEY('o'):
+            editorFoldToggle();
+            break;
+
+        case CTRL_KEY('t'):
+            editorFoldAll();
+            break;
+
+        case CTRL_KEY('w'):
+            // Keep the top row in place when switching modes
+            E.wrap = !E.wrap;
+            E.line_offset = editorScreenLineOf(E.row_offset);
+            editorSetStatusMessage("Soft wrap %s", E.wrap ? "on" : "off");
+            break;
+
         case BACKSPACE:
         case CTRL_KEY('h'):
         case DEL_KEY:
@@ -1275,10 +5647,31 @@ void editorProcessKeypress() {
         case PAGE_UP:
         case PAGE_DOWN:
             { // Creating a code block, {...}, to allow declaration of rows variable
+                if (E.wrap) {
+                    // Move a screen of wrapped lines, landing at the start
+                    // of whichever part of a row the target line shows
+                    int line = E.line_offset - E.screen_rows;
+                    if (c == PAGE_DOWN) {
+                        line = E.line_offset + 2 * E.screen_rows - 1;
+                    }
+                    int last = editorScreenLineOf(E.num_rows);
+                    line = line < 0 ? 0 : (line > last ? last : line);
+
+                    int sub;
+                    int start = 0;
+                    E.cy = editorScreenFindLine(line, &sub);
+                    if (E.cy < E.num_rows) {
+                        editorWrapSeek(&E.row[E.cy], sub, INT_MAX, &start);
+                    }
+                    E.cx = (E.cy < E.num_rows) ? editorRowRxToCx(&E.row[E.cy], start) : 0;
+                    break;
+                }
+
                 if (c == PAGE_UP) {
                     E.cy = E.row_offset;
                 } else if (c == PAGE_DOWN) {
-                    E.cy = E.row_offset + E.screen_rows - 1;
+                    int sub;
+                    E.cy = editorScreenFindLine(E.line_offset + E.screen_rows - 1, &sub);
                     if (E.cy > E.num_rows) {
                         E.cy = E.num_rows;
                     }
@@ -1310,6 +5703,654 @@ void editorProcessKeypress() {
     quit_times = EDI_QUIT_TIMES;
 }
 
+// ******** LEXER GENERATOR ********
+
+#ifdef EDI_LEXGEN
+
+// Everything below writes edi_lexers.h (see the Makefile): one scanner per
+// HLDB syntax, with its DFA turned into code. Comment delimiters, quotes
+// and keywords end up as constants in switches instead of table lookups.
+
+const char* HL_NAMES[] = {
+    "HL_NORMAL", "HL_COMMENT", "HL_MLCOMMENT", "HL_KEYWORD1",
+    "HL_KEYWORD2", "HL_STRING", "HL_NUMBER", "HL_MATCH", "HL_BRACKET"
+};
+
+void editorGenCase(int c) {
+    if (isalnum(c) || (ispunct(c) && c != '\'' && c != '\\')) {
+        printf("case '%c':", c);
+    } else {
+        printf("case %d:", c);
+    }
+}
+
+// Case labels for every byte taking the same edge as byte c out of 'edges'
+void editorGenCases(struct editorDfaEdge* edges, int c, const char* indent) {
+    int n = 0;
+    printf("%s", indent);
+    for (int b = 0; b < 256; b++) {
+        if (!memcmp(&edges[b], &edges[c], sizeof(struct editorDfaEdge))) {
+            if (n && n % 8 == 0) {
+                printf("\n%s", indent);
+            } else if (n) {
+                printf(" ");
+            }
+            editorGenCase(b);
+            n++;
+        }
+    }
+    printf("\n");
+}
+
+// The edge taken by most bytes, used as the switch's default
+int editorGenDefault(struct editorDfaEdge* edges) {
+    int best = 0;
+    int best_n = 0;
+    for (int c = 0; c < 256; c++) {
+        int n = 0;
+        for (int b = 0; b < 256; b++) {
+            n += !memcmp(&edges[b], &edges[c], sizeof(struct editorDfaEdge));
+        }
+        if (n > best_n) {
+            best = c;
+            best_n = n;
+        }
+    }
+    return best;
+}
+
+void editorGenEdge(struct editorSyntax* syntax, int id, int state, struct editorDfaEdge e, const char* in) {
+    int normal = state < syntax->dfa_prefix;
+    switch (e.action) {
+        case DFA_EMIT:
+            printf("%shl[i++] = %s;\n%sstate = %d;\n", in, HL_NAMES[e.hl], in, e.next);
+            break;
+        case DFA_RUN:
+            printf("%s{\n%s    int j = editorLexer%dRun%d(render, i + 1, limit);\n", in, in, id, e.next);
+            printf("%s    memset(&hl[i], %s, j - i);\n%s    i = j;\n", in, HL_NAMES[e.hl], in);
+            printf("%s    state = %d;\n%s}\n", in, e.next, in);
+            break;
+        case DFA_KEYWORD:
+            printf("%s{\n%s    int len = 1;\n", in, in);
+            printf("%s    while (len <= %d && !editorLexer%dIsSep(render[i + len])) {\n", in, syntax->keyword_max_len, id);
+            printf("%s        len++;\n%s    }\n", in, in);
+            printf("%s    int kw = (len <= %d) ? editorLexer%dKeyword(&render[i], len) : 0;\n", in, syntax->keyword_max_len, id);
+            printf("%s    if (kw) {\n%s        memset(&hl[i], kw, len);\n", in, in);
+            printf("%s        i += len;\n%s        state = DFA_WORD;\n", in, in);
+            printf("%s    } else {\n%s        hl[i++] = %s;\n", in, in, HL_NAMES[e.hl]);
+            printf("%s        state = %d;\n%s    }\n%s}\n", in, e.next, in, in);
+            break;
+        case DFA_ESCAPE:
+            printf("%shl[i] = HL_STRING;\n%sif (i + 1 < rsize) {\n", in, in);
+            printf("%s    hl[++i] = HL_STRING;\n%s}\n%si++;\n", in, in, in);
+            break;
+        case DFA_PREFIX:
+            if (normal) {
+                printf("%sfrom = i;\n%sfrom_state = state;\n", in, in);
+            }
+            printf("%si++;\n%sstate = %d;\n", in, in, e.next);
+            break;
+        case DFA_FAIL:
+            if (syntax->dfa_accept[state]) {
+                printf("%smemset(&hl[from], HL_MLCOMMENT, %d);\n", in, syntax->mcs_len);
+                printf("%si = from + %d;\n%sstate = %d;\n", in, syntax->mcs_len, in, syntax->dfa_comment);
+            } else {
+                printf("%si = from;\n%sstate = from_state;\n%salt = 1;\n", in, in, in);
+            }
+            break;
+        case DFA_SCS:
+            printf("%smemset(&hl[%s], HL_COMMENT, rsize - %s);\n", in, normal ? "i" : "from", normal ? "i" : "from");
+            printf("%sst->in_string = 0;\n%sst->in_comment = 0;\n%sreturn rsize;\n", in, in, in);
+            break;
+        case DFA_MCS:
+            if (normal) {
+                printf("%shl[i++] = HL_MLCOMMENT;\n", in);
+            } else {
+                printf("%si++;\n%smemset(&hl[from], HL_MLCOMMENT, i - from);\n", in, in);
+            }
+            printf("%sstate = %d;\n", in, syntax->dfa_comment);
+            break;
+    }
+}
+
+// switch (c) over the edges of one state
+void editorGenState(struct editorSyntax* syntax, int id, int state, struct editorDfaEdge* edges) {
+    int def = editorGenDefault(edges);
+    unsigned char done[256] = {0};
+    printf("                switch (c) {\n");
+    for (int c = 0; c < 256; c++) {
+        if (done[c] || !memcmp(&edges[c], &edges[def], sizeof(struct editorDfaEdge))) {
+            continue;
+        }
+        for (int b = c; b < 256; b++) {
+            if (!memcmp(&edges[b], &edges[c], sizeof(struct editorDfaEdge))) {
+                done[b] = 1;
+            }
+        }
+        editorGenCases(edges, c, "                    ");
+        editorGenEdge(syntax, id, state, edges[c], "                        ");
+        printf("                        break;\n");
+    }
+    printf("                    default:\n");
+    editorGenEdge(syntax, id, state, edges[def], "                        ");
+    printf("                        break;\n                }\n                break;\n");
+}
+
+void editorGenLexer(struct editorSyntax* syntax, int id) {
+    editorCompileSyntax(syntax);
+    printf("// ---- %s ----\n\n", syntax->file_type);
+
+    printf("int editorLexer%dIsSep(int c) {\n    switch (c) {\n", id);
+    for (int c = 0; c < 256; c++) {
+        if (syntax->char_class[c] & CC_SEPARATOR) {
+            printf("        ");
+            editorGenCase(c);
+            printf("\n");
+        }
+    }
+    printf("            return 1;\n    }\n    return 0;\n}\n\n");
+
+    // Earlier keywords win over later equal ones, as in the hash table
+    printf("int editorLexer%dKeyword(const unsigned char* s, int len) {\n    switch (len) {\n", id);
+    for (int len = 1; len <= syntax->keyword_max_len; len++) {
+        int any = 0;
+        for (int k = 0; syntax->keywords[k]; k++) {
+            const char* word = syntax->keywords[k];
+            int n = strlen(word);
+            int kw2 = word[n - 1] == '|';
+            if (n - kw2 != len) {
+                continue;
+            }
+            int first = 1;
+            for (int j = 0; j < k; j++) {
+                const char* other = syntax->keywords[j];
+                int m = strlen(other);
+                m -= other[m - 1] == '|';
+                if (m == len && !strncmp(other, word, len)) {
+                    first = 0;
+                }
+            }
+            if (!first) {
+                continue;
+            }
+            if (!any) {
+                printf("        case %d:\n", len);
+                any = 1;
+            }
+            printf("            if (!memcmp(s, \"%.*s\", %d)) {\n", len, word, len);
+            printf("                return %s;\n            }\n", kw2 ? "HL_KEYWORD2" : "HL_KEYWORD1");
+        }
+        if (any) {
+            printf("            break;\n");
+        }
+    }
+    printf("    }\n    return 0;\n}\n\n");
+
+    // Where a run of bytes taking a state's DFA_RUN edges ends
+    for (int state = 0; state < syntax->dfa_states; state++) {
+        struct editorDfaEdge* edges = &syntax->dfa[state * 256];
+        int runs = 0;
+        for (int c = 0; c < 256; c++) {
+            runs |= edges[c].action == DFA_RUN;
+        }
+        if (!runs) {
+            continue;
+        }
+        printf("int editorLexer%dRun%d(const unsigned char* p, int j, int limit) {\n", id, state);
+        printf("    for (; j < limit; j++) {\n        switch (p[j]) {\n");
+        for (int c = 0; c < 256; c++) {
+            if (edges[c].action != DFA_RUN) {
+                printf("            ");
+                editorGenCase(c);
+                printf("\n");
+            }
+        }
+        printf("                return j;\n        }\n    }\n    return j;\n}\n\n");
+    }
+
+    printf("int editorLexer%d(erow* row, int i, int limit, struct editorHlState* st) {\n", id);
+    printf("    const unsigned char* render = (const unsigned char*) row->render;\n");
+    printf("    unsigned char* hl = row->hl;\n    int rsize = row->rsize;\n");
+    printf("    int state = editorDfaStartState(E.syntax, row, i, st);\n");
+    // Only needed to match multi-byte comment starts
+    int prefixes = syntax->dfa_states > syntax->dfa_prefix;
+    if (prefixes) {
+        printf("    int from = i;\n    int from_state = state;\n    int alt = 0;\n");
+    }
+    printf("\n");
+    printf("    while (i < limit || state >= %d) {\n", syntax->dfa_pending);
+    printf("        if (i >= rsize && state < %d) {\n            break;\n        }\n", syntax->dfa_prefix);
+    printf("        int c = render[i];\n");
+    if (prefixes) {
+        printf("        if (alt) {\n            alt = 0;\n            switch (state) {\n");
+        for (int state = 0; state < DFA_NORMAL_STATES; state++) {
+            printf("            case %d:\n", state);
+            editorGenState(syntax, id, state, &syntax->dfa_alt[state * 256]);
+        }
+        printf("            }\n            continue;\n        }\n\n");
+    }
+    printf("        switch (state) {\n");
+    for (int state = 0; state < syntax->dfa_states; state++) {
+        printf("            case %d:\n", state);
+        editorGenState(syntax, id, state, &syntax->dfa[state * 256]);
+    }
+    printf("        }\n    }\n\n");
+    printf("    editorDfaEndState(E.syntax, state, st);\n    return i;\n}\n\n");
+}
+
+void editorGenerateLexers() {
+    printf("// Generated from HLDB in edi.c by `make edi_lexers.h`. Do not edit.\n\n");
+    for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
+        editorGenLexer(&HLDB[j], j);
+    }
+    printf("int (*editorLexers[])(erow* row, int i, int limit, struct editorHlState* st) = {\n");
+    for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
+        printf("    editorLexer%u,\n", j);
+    }
+    printf("};\n");
+}
+
+#endif
+
+#ifdef EDI_BENCH
+
+// Best time of a few rounds of highlighting every row from scratch
+double editorBenchHighlight() {
+    double best = 0;
+    for (int round = 0; round < 5; round++) {
+        editorSelectSyntaxHighlight();
+        double start = editorNow();
+        for (int r = 0; r < E.num_rows; r++) {
+            editorSyntaxEnsure(&E.row[r]);
+        }
+        double t = editorNow() - start;
+        if (round == 0 || t < best) {
+            best = t;
+        }
+    }
+    return best;
+}
+
+// Highlight every row of a file with the generic and the generated scanner
+// and print how fast each was (`make bench FILE=...`). Files of no known
+// type, such as logs, are timed as the plain text they are shown as.
+void editorBenchLexers(char* filename) {
+    E.screen_cols = 80;
+    E.wrap_index.cols = 80;
+    E.wrap_index.lines = editorWrapRowLines;
+    E.fold_index.lines = editorFoldRowLines;
+    editorOpen(filename);
+
+    long bytes = 0;
+    for (int r = 0; r < E.num_rows; r++) {
+        bytes += E.row[r].rsize;
+    }
+
+    if (E.syntax == NULL) {
+        printf("%s: %.1f MB, %d rows, plain text\n", filename, bytes / 1e6, E.num_rows);
+        double best = editorBenchHighlight();
+        printf("  %-9s %8.1f ms %8.1f MB/s\n", "plain", best, bytes / 1e3 / best);
+    } else if (E.syntax->scan == editorSyntaxScanDfa) {
+        printf("%s: no generated lexer for this file type\n", filename);
+        return;
+    } else {
+        int (*scanners[])(erow* row, int i, int limit, struct editorHlState* st) = {
+            editorSyntaxScanDfa, E.syntax->scan
+        };
+        const char* names[] = { "generic", "generated" };
+        unsigned long hash[2];
+        printf("%s: %.1f MB, %d rows, %s\n", filename, bytes / 1e6, E.num_rows, E.syntax->file_type);
+        for (int k = 0; k < 2; k++) {
+            E.syntax->scan = scanners[k];
+            double best = editorBenchHighlight();
+
+            hash[k] = 5381;
+            for (int r = 0; r < E.num_rows; r++) {
+                for (int i = 0; i < E.row[r].rsize; i++) {
+                    hash[k] = hash[k] * 33 + editorHlAt(&E.row[r], i);
+                }
+            }
+            printf("  %-9s %8.1f ms %8.1f MB/s\n", names[k], best, bytes / 1e3 / best);
+        }
+        printf("  highlighting %s\n", hash[0] == hash[1] ? "identical" : "DIFFERS");
+    }
+
+    long stored, dense;
+    editorHlMemory(&stored, &dense);
+    printf("  hl memory %.2f MB, %.2f MB at a byte per char\n", stored / 1e6, dense / 1e6);
+}
+
+// Work out the comment states of rows [0, to) from scratch with up to
+// 'threads' chunks, best of 5 runs, and count the rows whose state is not
+// the one in want[] (if given)
+double editorBenchStates(int threads, int to, const int* want, int* differ) {
+    E.hl_threads = threads;
+    double best = 0;
+    for (int round = 0; round < 5; round++) {
+        E.hl_frontier = 0;
+        for (int r = 0; r < E.num_rows; r++) {
+            E.row[r].hl_start_comment = -1;
+            E.row[r].hl_ready = 0;
+        }
+        double start = editorNow();
+        editorSyntaxAdvance(to);
+        double t = editorNow() - start;
+        if (round == 0 || t < best) {
+            best = t;
+        }
+    }
+    *differ = 0;
+    for (int r = 0; want && r < to; r++) {
+        *differ += E.row[r].hl_open_comment != want[r];
+    }
+    return best;
+}
+
+// Move the frontier down the whole file on 1, 2, 4... threads, up to one
+// per CPU, and print how fast that was. The comment states have to come
+// out as they do on one thread, also with more chunks than CPUs, and on
+// rows made up so that every other chunk starts inside a comment: so even
+// one CPU checks the wrong guesses being fixed up.
+void editorBenchFrontier() {
+    if (E.syntax == NULL || !E.syntax->mcs_len || !E.syntax->mce_len) {
+        return;
+    }
+    E.hl_threads = editorHlThreads();
+    editorStartHlPool();
+    int cpus = E.hl_threads;
+
+    long bytes = 0;
+    for (int r = 0; r < E.num_rows; r++) {
+        bytes += E.row[r].rsize;
+    }
+    int differ;
+    int bad = 0;
+    printf("comment states, %d CPU%s\n", cpus, cpus == 1 ? "" : "s");
+    editorBenchStates(1, E.num_rows, NULL, &differ);
+    int* want = malloc(sizeof(int) * (E.num_rows + 1));
+    for (int r = 0; r < E.num_rows; r++) {
+        want[r] = E.row[r].hl_open_comment;
+    }
+    for (int threads = 1; threads <= EDI_HL_THREADS; threads *= 2) {
+        if (threads > 16 && threads > cpus) {
+            break;
+        }
+        double t = editorBenchStates(threads, E.num_rows, want, &differ);
+        bad += differ;
+        printf("  %2d thread%s %8.1f ms %8.1f MB/s%s\n", threads, threads == 1 ? " " : "s",
+               t, bytes / 1e3 / t, threads > cpus ? "  (more than CPUs)" : "");
+    }
+
+    // Rows opening and closing a comment in turn, in chunks of an odd
+    // number of rows
+    erow* rows = E.row;
+    int num_rows = E.num_rows;
+    E.row = NULL;
+    E.num_rows = 0;
+    int chunk = 2 * EDI_HL_CHUNK + 1;
+    int n = 16 * chunk;
+    char line[64];
+    for (int r = 0; r < n; r++) {
+        int len = snprintf(line, sizeof(line), "%s %s %s", (r & 1) ? "y" : "x",
+                           (r & 1) ? E.syntax->multiline_comment_end : E.syntax->multiline_comment_start,
+                           (r & 1) ? "z" : "w");
+        editorInsertRow(r, line, len);
+    }
+    want = realloc(want, sizeof(int) * n);
+    editorBenchStates(1, n, NULL, &differ);
+    for (int r = 0; r < n; r++) {
+        want[r] = E.row[r].hl_open_comment;
+    }
+    int chunks = E.stats.hl_chunks;
+    int wrong = E.stats.hl_chunks_wrong;
+    for (int threads = 2; threads <= 16; threads *= 2) {
+        editorBenchStates(threads, threads * chunk, want, &differ);
+        bad += differ;
+    }
+    printf("  %d of %d chunks of comments guessed wrong and fixed up\n",
+           E.stats.hl_chunks_wrong - wrong, E.stats.hl_chunks - chunks);
+    printf("  comment states %s\n", bad ? "DIFFER" : "identical");
+
+    while (E.num_rows) {
+        editorDelRow(E.num_rows - 1);
+    }
+    free(E.row);
+    E.row = rows;
+    E.num_rows = num_rows;
+    free(want);
+}
+
+// Wrap the rows with chars other than ASCII, and two mixing wide chars,
+// combining marks and tabs, at widths that cut through wide chars. Each
+// row's lines have to draw all of its render exactly once, and the cursor
+// on each char has to land on the line that draws it.
+void editorBenchWrap() {
+    const char* mix = "ab\xe6\xbc\xa2\xe5\xad\x97" "c\te\xcc\x81\xe3\x81\x8b\xe3\x81\xaa ";
+    int mix_len = strlen(mix);
+    char line[1024];
+    int len = 0;
+    for (; len + mix_len <= (int) sizeof(line); len += mix_len) {
+        memcpy(&line[len], mix, mix_len);
+    }
+    int num_rows = E.num_rows;
+    editorInsertRow(num_rows, line, len);
+    editorInsertRow(num_rows + 1, &line[2], len - 2);
+
+    int screen_cols = E.screen_cols;
+    int widths[] = { 80, 13, 9, 8 };
+    struct editorView view;
+    view.line_cap = 80 * 4 + 16;
+    view.line_kind = malloc(sizeof(int));
+    view.line_len = malloc(sizeof(int));
+    view.text = malloc(view.line_cap);
+    view.hl = malloc(view.line_cap);
+    int* starts = NULL;
+    char* shown = NULL;
+    int checked = 0;
+    int wrong = 0;
+    for (int r = 0; r < E.num_rows; r++) {
+        erow* row = &E.row[r];
+        if (row->ascii || row->size > 4096) {
+            continue;
+        }
+        checked++;
+        starts = realloc(starts, sizeof(int) * (row->rwidth + 2));
+        shown = realloc(shown, row->rsize + view.line_cap);
+        for (unsigned int w = 0; w < sizeof(widths) / sizeof(widths[0]); w++) {
+            int cols = widths[w];
+            E.screen_cols = view.screen_cols = cols;
+
+            // Draw the lines one after another as a frame does
+            struct erowPos pos = {0, 0, 0};
+            int lines = 0;
+            int shown_len = 0;
+            for (int start = 0; start >= 0; lines++) {
+                int sub_start;
+                wrong += editorWrapSeek(row, lines, INT_MAX, &sub_start) != lines || sub_start != start;
+                starts[lines] = start;
+                int next = editorWrapNext(row, &pos, start);
+                editorSnapshotRowSpan(&view, 0, row, start, next >= 0 ? next - start : cols);
+                if (shown_len + view.line_len[0] <= row->rsize) {
+                    memcpy(&shown[shown_len], view.text, view.line_len[0]);
+                }
+                shown_len += view.line_len[0];
+                start = next;
+            }
+            wrong += lines != editorWrapRowLines(row);
+            wrong += shown_len != row->rsize || memcmp(shown, row->render, row->rsize);
+
+            struct erowPos at = {0, 0, 0};
+            while (1) {
+                if (!editorRowZeroWidthAt(row, at.cx)) {
+                    int start;
+                    int sub = editorWrapSeek(row, INT_MAX, at.rx, &start);
+                    wrong += sub >= lines || start != starts[sub] || at.rx - start >= cols ||
+                        (sub + 1 < lines && at.rx >= starts[sub + 1]);
+                }
+                if (at.cx == row->size) {
+                    break;
+                }
+                struct erowPos limit = {editorRowNextChar(row, at.cx), INT_MAX, INT_MAX};
+                editorRowWalk(row, &at, &limit);
+            }
+        }
+    }
+    printf("wrap of %d rows with wide chars at 80, 13, 9 and 8 columns %s\n",
+           checked, wrong ? "WRONG" : "right");
+
+    E.screen_cols = screen_cols;
+    free(view.line_kind);
+    free(view.line_len);
+    free(view.text);
+    free(view.hl);
+    free(starts);
+    free(shown);
+    editorDelRow(num_rows + 1);
+    editorDelRow(num_rows);
+}
+
+// Search every row of the file for 'query' with strstr() over render, as
+// edi used to, and over chars with each search kernel, and print how fast
+// each was. Rows with tabs can count differently. Then check the offsets
+// each kernel finds, and the overlay drawn for them. With no query
+// (or an empty one) it looks for the last 20 bytes of the file, so that
+// every row is searched.
+void editorBenchSearch(const char* query) {
+    long bytes = 0;
+    for (int r = 0; r < E.num_rows; r++) {
+        bytes += E.row[r].size;
+    }
+    char tail[21] = "";
+    if (query && query[0] == '\0') {
+        query = NULL;
+    }
+    for (int r = E.num_rows - 1; query == NULL && r >= 0; r--) {
+        if (E.row[r].size >= 20) {
+            memcpy(tail, &E.row[r].chars[E.row[r].size - 20], 20);
+            query = tail;
+        }
+    }
+    if (query == NULL) {
+        return;
+    }
+
+    struct editorSearch s;
+    editorSearchPrepare(&s, query);
+    int (*kernels[5])(const struct editorSearch*, const char*, int, int) = {
+        NULL, editorSearchScalar, editorSearchHorspool
+    };
+    const char* names[5] = { "strstr", "scalar", "horspool" };
+    int n_kernels = 3;
+#ifdef __SSE2__
+    names[n_kernels] = "sse2";
+    kernels[n_kernels++] = editorSearchSse2;
+#endif
+#ifdef EDI_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        names[n_kernels] = "avx2";
+        kernels[n_kernels++] = editorSearchAvx2;
+    }
+#endif
+
+    printf("search for \"%s\" (%d bytes) in %.1f MB\n", query, s.len, bytes / 1e6);
+    printf("  %-9s %8s %10s %8s\n", "kernel", "ms", "MB/s", "rows");
+    int first_rows = 0;
+    int identical = 1;
+    for (int k = 0; k < n_kernels; k++) {
+        // The kernels filtering on two bytes need at least two
+        if (k > 0 && s.len < 2) {
+            break;
+        }
+        double best = 0;
+        int rows = 0;
+        for (int round = 0; round < 5; round++) {
+            double start = editorNow();
+            rows = 0;
+            for (int r = 0; r < E.num_rows; r++) {
+                erow* row = &E.row[r];
+                if (kernels[k] ? kernels[k](&s, row->chars, 0, row->size) >= 0 : strstr(row->render, query) != NULL) {
+                    rows++;
+                }
+            }
+            double t = editorNow() - start;
+            if (round == 0 || t < best) {
+                best = t;
+            }
+        }
+        if (k == 0) {
+            first_rows = rows;
+        }
+        identical &= rows == first_rows;
+        printf("  %-9s %8.1f %10.1f %8d\n", names[k], best, bytes / 1e3 / best, rows);
+    }
+    printf("  matches %s\n", identical ? "identical" : "DIFFER");
+
+    // Every kernel has to find each match memmem() does, from every offset
+    // just past the one before
+    long found = 0;
+    int wrong = 0;
+    for (int r = 0; r < E.num_rows; r++) {
+        erow* row = &E.row[r];
+        for (int i = 0; i <= row->size; i++) {
+            char* m = memmem(&row->chars[i], row->size - i, query, s.len);
+            int want = m ? m - row->chars : -1;
+            wrong += editorSearchIn(&s, row->chars, i, row->size) != want;
+            for (int k = 1; k < n_kernels && s.len >= 2; k++) {
+                wrong += kernels[k](&s, row->chars, i, row->size) != want;
+            }
+            if (want < 0) {
+                break;
+            }
+            found++;
+            i = want;
+        }
+    }
+    printf("  offsets of %ld matches %s\n", found, wrong ? "DIFFER" : "identical");
+
+    // The overlay of each row with matches, wrapped so all of it is shown,
+    // has to hold each match in turn with its render range worked out from
+    // the start of the row. Without a tab in the match, render holds the
+    // same bytes there.
+    int wrap = E.wrap;
+    int screen_rows = E.screen_rows;
+    E.wrap = 1;
+    editorSearchPrepare(&E.find, query);
+    found = 0;
+    wrong = 0;
+    for (int r = 0; r < E.num_rows; r++) {
+        erow* row = &E.row[r];
+        int at = editorSearchIn(&s, row->chars, 0, row->size);
+        if (at < 0) {
+            continue;
+        }
+        E.screen_rows = editorWrapRowLines(row);
+        editorOverlayBuild(r, 0);
+        int k = 0;
+        for (; at >= 0; at = editorSearchIn(&s, row->chars, at + s.len, row->size), k++) {
+            found++;
+            if (k >= E.overlay_len) {
+                wrong++;
+                continue;
+            }
+            struct editorOverlay* o = &E.overlay[k];
+            int start = editorRowSeek(row, at, INT_MAX, INT_MAX).ri;
+            int end = editorRowSeek(row, at + s.len, INT_MAX, INT_MAX).ri;
+            int same = memchr(&row->chars[at], '\t', s.len) ||
+                (end - start == s.len && !memcmp(&row->render[start], &row->chars[at], s.len));
+            wrong += o->row != r || o->start != start || o->end != end || !same;
+        }
+        wrong += E.overlay_len > k;
+    }
+    printf("  overlay of %ld matches %s\n", found, wrong ? "WRONG" : "right");
+    editorSearchFree(&E.find);
+    E.overlay_len = 0;
+    E.wrap = wrap;
+    E.screen_rows = screen_rows;
+    editorSearchFree(&s);
+}
+
+#endif
+
 // ******** INIT ********
 
 void initEditor() {
@@ -1318,6 +6359,8 @@ void initEditor() {
     E.rx = 0;
     E.row_offset = 0;
     E.col_offset = 0;
+    E.wrap = 0;
+    E.line_offset = 0;
     E.num_rows = 0;
     E.row = NULL;
     E.dirty = 0;
@@ -1325,6 +6368,33 @@ void initEditor() {
     E.statusmsg[0] = '\0';
     E.statusmsg_time = 0;
     E.syntax = NULL;
+    E.overlay = NULL;
+    E.overlay_len = 0;
+    E.overlay_cap = 0;
+    E.find.needle = NULL;
+    E.wrap_index.tree = NULL;
+    E.wrap_index.cap = 0;
+    E.wrap_index.valid = 0;
+    E.wrap_index.lines = editorWrapRowLines;
+    E.fold_index.tree = NULL;
+    E.fold_index.cap = 0;
+    E.fold_index.valid = 0;
+    E.fold_index.cols = 0;
+    E.fold_index.lines = editorFoldRowLines;
+    E.hidden_rows = 0;
+    E.br_tree = NULL;
+    E.br_leaves = 0;
+    E.br_valid = 0;
+    E.br_top = 0;
+    E.br_bottom = 0;
+    E.br_pending = 0;
+    E.hl_frontier = 0;
+    E.hl_deadline = 0;
+    E.hl_provisional = -1;
+    E.hl_threads = editorHlThreads();
+    E.hl_epoch = 0;
+    E.hl_scratch = NULL;
+    E.hl_scratch_cap = 0;
 
     if (getWindowSize(&E.screen_rows, &E.screen_cols) == -1) {
         die("getWindowSize");
@@ -1332,17 +6402,41 @@ void initEditor() {
 
     // Use the last 2 rows for the status bar and the message bar
     E.screen_rows -= 2;
+    E.wrap_index.cols = E.screen_cols;
+
+    editorDetectTerminal();
+
+    editorStartRender();
+    editorStartHlWorker();
+    editorStartHlPool();
 }
 
 int main(int argc, char* argv[]) {
+#ifdef EDI_LEXGEN
+    editorGenerateLexers();
+    return 0;
+#endif
+#ifdef EDI_BENCH
+    editorBenchLexers(argc >= 2 ? argv[1] : "edi.c");
+    editorBenchSearch(argc >= 3 ? argv[2] : NULL);
+    editorBenchFrontier();
+    editorBenchWrap();
+    return 0;
+#endif
+    // Registered before raw mode so it runs after the terminal is restored
+    if (getenv("EDI_STATS")) {
+        atexit(editorPrintStats);
+    }
     enableRawMode();
     initEditor();
+
+    editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+    // A problem with a syntax file replaces the help message
+    editorLoadSyntaxFiles();
     if (argc >= 2) {
         editorOpen(argv[1]);
     }
 
-    editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
-
     while (1) {
         editorRefreshScreen();
         editorProcessKeypress();